@@ -0,0 +1,241 @@
+-- lua_cmsgpack.c lib benchmarks
+-- See the license at the end of lua_cmsgpack.c.
+--
+-- Usage: lua bench.lua [options]   (or ./bench bench.lua [options])
+--
+--   -t <seconds>   minimum time of every timed round (default 0.2)
+--   -r <rounds>    timed rounds per benchmark, the median is kept (default 5)
+--   -f <pattern>   only run the benchmarks whose name matches the pattern
+--   -l <label>     label stored in the results, e.g. the commit id
+--   -o <file>      write the results to <file>
+--   -c <file>      compare against results previously written with -o
+--   -x <percent>   with -c, exit with an error if any benchmark got slower
+--                  than <percent> (default: only report)
+--
+-- The results file is tab separated, one benchmark per line, so that it is
+-- easy to diff, to load in a spreadsheet or to compare with -c.
+--
+-- When run by the C harness (bench.c) allocations are counted by the Lua
+-- allocator, otherwise only the bytes are estimated from the GC counters
+-- and the allocation count is reported as "-".
+
+local cmsgpack = require "cmsgpack"
+
+local clock = bench_clock or os.clock
+local allocs = bench_allocs
+
+local opt = {t = 0.2, r = 5, l = ""}
+local known = {t = true, r = true, f = true, l = true, o = true, c = true,
+               x = true}
+local i = 1
+while arg and arg[i] do
+    local k = string.match(arg[i],"^%-(%a)$")
+    if not known[k] or not arg[i+1] then
+        error("Bad option '"..arg[i].."', see the usage at the top of bench.lua")
+    end
+    opt[k] = arg[i+1]
+    i = i + 2
+end
+opt.t = tonumber(opt.t)
+opt.r = tonumber(opt.r)
+opt.x = opt.x and tonumber(opt.x)
+
+-- Corpus shapes. Every shape is a function returning a fresh object, so
+-- that the construction cost is never part of the timed loops.
+
+local shapes = {}
+local order = {}
+
+local function shape(name, fn)
+    shapes[name] = fn
+    order[#order+1] = name
+end
+
+local function record(i)
+    return {id = i, name = "user"..(i%97), active = (i%2 == 0),
+            score = i/7, tags = {"a", "bc", "def"}}
+end
+
+-- A single small record, the typical RPC or cache entry.
+shape("small_record", function()
+    return record(12345)
+end)
+
+-- A map with many string keys and mixed values.
+shape("wide_map", function()
+    local t = {}
+    for i = 1, 1000 do
+        t["field_"..i] = (i%3 == 0) and ("v"..i) or (i%3 == 1 and i or i+0.25)
+    end
+    return t
+end)
+
+-- Nested maps and arrays, 200 levels deep.
+shape("deep_nesting", function()
+    local t = {leaf = true}
+    for i = 1, 200 do
+        if i%2 == 0 then t = {t, i} else t = {level = i, child = t} end
+    end
+    return t
+end)
+
+-- Numeric arrays covering every integer width plus doubles.
+shape("numeric_array", function()
+    local t = {}
+    for i = 1, 10000 do
+        local k = i%5
+        if k == 0 then t[i] = i%128
+        elseif k == 1 then t[i] = -(i%32768)
+        elseif k == 2 then t[i] = i*65537
+        elseif k == 3 then t[i] = i*4294967296
+        else t[i] = i+0.5 end
+    end
+    return t
+end)
+
+-- Large binary blobs.
+shape("large_blobs", function()
+    local t = {}
+    for i = 1, 4 do
+        t[i] = string.rep(string.char(i*31%256), 256*1024)
+    end
+    return t
+end)
+
+-- Mixed traffic: a batch of messages of different kinds.
+shape("mixed_traffic", function()
+    local t = {}
+    for i = 1, 100 do
+        local k = i%4
+        if k == 0 then t[i] = record(i)
+        elseif k == 1 then t[i] = string.rep("x", i*10)
+        elseif k == 2 then t[i] = {i, -i, i*1000, i/3, true, false}
+        else t[i] = {cmd = "set", key = "key:"..i, args = {i, "p"..i}} end
+    end
+    return t
+end)
+
+-- Measurement.
+
+local function median(v)
+    table.sort(v)
+    return v[math.floor((#v+1)/2)]
+end
+
+-- Return the number of iterations needed to run fn for opt.t seconds.
+local function calibrate(fn, x)
+    local n = 1
+    while true do
+        local t = clock()
+        for _ = 1, n do fn(x) end
+        local dt = clock() - t
+        if dt >= opt.t then return n end
+        if dt < opt.t/100 then n = n*10 else n = math.ceil(n*opt.t/dt*1.1) end
+    end
+end
+
+-- Count allocations over n calls with the GC stopped, so that the byte
+-- estimate from collectgarbage("count") is meaningful too.
+local function measure_allocs(fn, x, n)
+    collectgarbage("collect")
+    collectgarbage("stop")
+    local c0, b0 = 0, collectgarbage("count")*1024
+    if allocs then c0, b0 = allocs() end
+    for _ = 1, n do fn(x) end
+    local c1, b1 = 0, collectgarbage("count")*1024
+    if allocs then c1, b1 = allocs() end
+    collectgarbage("restart")
+    collectgarbage("collect")
+    return allocs and (c1-c0)/n, (b1-b0)/n
+end
+
+local function run(name, fn, x, size)
+    local n = calibrate(fn, x)
+    local times = {}
+    for r = 1, opt.r do
+        collectgarbage("collect")
+        local t = clock()
+        for _ = 1, n do fn(x) end
+        times[r] = (clock() - t)/n
+    end
+    local t = median(times)
+    local ac, ab = measure_allocs(fn, x, math.min(n, 1000))
+    return {name = name, size = size, ns = t*1e9, mbs = size/t/1e6,
+            allocs = ac, bytes = ab}
+end
+
+local results = {}
+for _, name in ipairs(order) do
+    if not opt.f or string.find(name, opt.f) then
+        local obj = shapes[name]()
+        local msg = cmsgpack.pack(obj)
+        results[#results+1] = run(name..".pack", cmsgpack.pack, obj, #msg)
+        results[#results+1] = run(name..".unpack", cmsgpack.unpack, msg, #msg)
+    end
+end
+
+-- The compiled encoders of the small record, to compare with its pack.
+for _, variant in ipairs({"compiled", "trusted"}) do
+    local name = "small_record."..variant
+    if not opt.f or string.find(name, opt.f) then
+        local obj = shapes.small_record()
+        local encode = cmsgpack.compile({"id", "name", "active", "score",
+                                         "tags"},
+                                        {trusted = variant == "trusted"})
+        results[#results+1] = run(name, encode, obj, #encode(obj))
+    end
+end
+
+-- Reporting.
+
+local function fmt_allocs(v)
+    return v and string.format("%.1f", v) or "-"
+end
+
+local header = "name\tmsg_bytes\tns_op\tmb_s\tallocs_op\tbytes_op"
+
+local function line(r)
+    return string.format("%s\t%d\t%.1f\t%.2f\t%s\t%.0f", r.name, r.size,
+                         r.ns, r.mbs, fmt_allocs(r.allocs), r.bytes)
+end
+
+print(string.format("%s %s %s", _VERSION, opt.l, allocs and "(counting allocator)" or ""))
+print(string.format("%-22s %10s %12s %10s %10s %12s", "benchmark", "msg bytes",
+                    "ns/op", "MB/s", "allocs/op", "bytes/op"))
+for _, r in ipairs(results) do
+    print(string.format("%-22s %10d %12.1f %10.2f %10s %12.0f", r.name, r.size,
+                        r.ns, r.mbs, fmt_allocs(r.allocs), r.bytes))
+end
+
+if opt.o then
+    local f = assert(io.open(opt.o, "w"))
+    f:write("# lua-cmsgpack bench\t", _VERSION, "\t", opt.l, "\n", header, "\n")
+    for _, r in ipairs(results) do f:write(line(r), "\n") end
+    f:close()
+end
+
+if opt.c then
+    local base = {}
+    for l in io.lines(opt.c) do
+        local name, ns = string.match(l, "^([^#\t][^\t]*)\t[^\t]*\t([^\t]*)")
+        if name and tonumber(ns) then base[name] = tonumber(ns) end
+    end
+    local worst = 0
+    print("")
+    print(string.format("%-22s %12s %12s %8s", "benchmark", "base ns/op",
+                        "ns/op", "change"))
+    for _, r in ipairs(results) do
+        local b = base[r.name]
+        if b then
+            local pct = (r.ns - b)/b*100
+            if pct > worst then worst = pct end
+            print(string.format("%-22s %12.1f %12.1f %+7.1f%%", r.name, b,
+                                r.ns, pct))
+        end
+    end
+    if opt.x and worst > opt.x then
+        print(string.format("Regression: %.1f%% slower (threshold %.1f%%)",
+                            worst, opt.x))
+        os.exit(1)
+    end
+end
@@ -3,15 +3,33 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 #include "lua.h"
 #include "lauxlib.h"
+#include "lua_cmsgpack.h"
+
+#ifndef LUA_FILEHANDLE
+#define LUA_FILEHANDLE "FILE*"  /* Defined in lualib.h by Lua 5.1. */
+#endif
 
 #define LUACMSGPACK_VERSION     "lua-cmsgpack 0.3.1"
 #define LUACMSGPACK_COPYRIGHT   "Copyright (C) 2012, Salvatore Sanfilippo"
 #define LUACMSGPACK_DESCRIPTION "MessagePack C implementation for Lua"
 
-#define LUACMSGPACK_MAX_NESTING  16 /* Max tables nesting. */
+#define LUACMSGPACK_MAX_NESTING  1000 /* Default max tables nesting. */
+#define LUACMSGPACK_SCAN_DEPTH    256 /* Max nesting validate() can follow. */
+#define LUACMSGPACK_INLINE_FRAMES  32 /* Work stack frames on the C stack. */
+#define LUACMSGPACK_REF_EXT       127 /* Ext type of tables references. */
+#define LUACMSGPACK_ARRAY_EXT     126 /* Ext type of typed numeric arrays. */
+#define LUACMSGPACK_TIMESTAMP_EXT  -1 /* Ext type of timestamps (spec). */
 
 /* ==============================================================================
  * MessagePack implementation and bindings for Lua 5.1/5.2.
@@ -33,71 +51,387 @@
  * ============================================================================ */
 
 /* --------------------------- Endian conversion --------------------------------
- * We use it only for floats and doubles, all the other conversions are performed
- * in an endian independent fashion. So the only thing we need is a function
- * that swaps a binary string if the arch is little endian (and left it untouched
- * otherwise). */
-
-/* Reverse memory bytes if arch is little endian. Given the conceptual
- * simplicity of the Lua build system we prefer to check for endianess at runtime.
- * The performance difference should be acceptable. */
-static void memrevifle(void *ptr, size_t len) {
-    unsigned char *p = ptr, *e = p+len-1, aux;
+ * MessagePack is big endian. Integers, floats and doubles are converted
+ * with the load and store functions below, that read or write a value at
+ * any address (no alignment is required) swapping its bytes if the arch
+ * is little endian.
+ *
+ * Endianess is detected at compile time when the compiler tells it, the
+ * swap is then a single instruction (or nothing at all). Otherwise it is
+ * checked at runtime, that is slower but always works. */
+
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__)
+#define MP_BIG_ENDIAN (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#elif defined(_WIN32) || defined(__i386__) || defined(__x86_64__)
+#define MP_BIG_ENDIAN 0
+#else
+static int mp_big_endian(void) {
     int test = 1;
-    unsigned char *testp = (unsigned char*) &test;
 
-    if (testp[0] == 0) return; /* Big endian, nothign to do. */
-    len /= 2;
-    while(len--) {
-        aux = *p;
-        *p = *e;
-        *e = aux;
-        p++;
-        e--;
-    }
+    return ((unsigned char*)&test)[0] == 0;
+}
+#define MP_BIG_ENDIAN mp_big_endian()
+#endif
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
+#define mp_bswap16(x) __builtin_bswap16(x)
+#define mp_bswap32(x) __builtin_bswap32(x)
+#define mp_bswap64(x) __builtin_bswap64(x)
+#elif defined(_MSC_VER)
+#define mp_bswap16(x) _byteswap_ushort(x)
+#define mp_bswap32(x) _byteswap_ulong(x)
+#define mp_bswap64(x) _byteswap_uint64(x)
+#else
+static uint16_t mp_bswap16(uint16_t x) {
+    return (uint16_t)((x << 8) | (x >> 8));
+}
+
+static uint32_t mp_bswap32(uint32_t x) {
+    return ((x & 0xff) << 24) | ((x & 0xff00) << 8) |
+           ((x >> 8) & 0xff00) | (x >> 24);
+}
+
+static uint64_t mp_bswap64(uint64_t x) {
+    return ((uint64_t)mp_bswap32((uint32_t)x) << 32) |
+           mp_bswap32((uint32_t)(x >> 32));
+}
+#endif
+
+static uint16_t mp_load16(const unsigned char *p) {
+    uint16_t v;
+
+    memcpy(&v,p,2);
+    return MP_BIG_ENDIAN ? v : mp_bswap16(v);
+}
+
+static uint32_t mp_load32(const unsigned char *p) {
+    uint32_t v;
+
+    memcpy(&v,p,4);
+    return MP_BIG_ENDIAN ? v : mp_bswap32(v);
+}
+
+static uint64_t mp_load64(const unsigned char *p) {
+    uint64_t v;
+
+    memcpy(&v,p,8);
+    return MP_BIG_ENDIAN ? v : mp_bswap64(v);
+}
+
+static void mp_store16(unsigned char *p, uint16_t v) {
+    if (!MP_BIG_ENDIAN) v = mp_bswap16(v);
+    memcpy(p,&v,2);
+}
+
+static void mp_store32(unsigned char *p, uint32_t v) {
+    if (!MP_BIG_ENDIAN) v = mp_bswap32(v);
+    memcpy(p,&v,4);
+}
+
+static void mp_store64(unsigned char *p, uint64_t v) {
+    if (!MP_BIG_ENDIAN) v = mp_bswap64(v);
+    memcpy(p,&v,8);
 }
 
+/* Floats and doubles are assumed to have the same endianess of integers,
+ * that is the case on every arch Lua runs on. */
+static float mp_load_float(const unsigned char *p) {
+    uint32_t v = mp_load32(p);
+    float f;
+
+    memcpy(&f,&v,4);
+    return f;
+}
+
+static double mp_load_double(const unsigned char *p) {
+    uint64_t v = mp_load64(p);
+    double d;
+
+    memcpy(&d,&v,8);
+    return d;
+}
+
+/* --------------------------------- Statistics ---------------------------------
+ * When compiled with LUACMSGPACK_STATS defined every codec collects the
+ * counters below, returned by cmsgpack.stats() and codec:stats(). Otherwise
+ * the counters and all the code updating them are compiled out, and the
+ * stats functions are not registered at all.
+ *
+ * Time is measured with LUACMSGPACK_STATS_CLOCK(), that must return the
+ * seconds elapsed from any fixed point as a double. It defaults to a
+ * monotonic clock where there is one, as bench.c does, and to the
+ * processor time from clock() elsewhere. Embedders can define it to
+ * another clock (or to 0 not to pay for the timing).
+ *
+ * Elements are counted by type as the encoder emits them, with
+ * mp_stats_type(). Output copied verbatim, such as pre-packed fragments, is
+ * walked with mp_stats_elements(), that also uncounts the output the table
+ * encoder throws away when it starts a table again in another format. */
+
+#ifdef LUACMSGPACK_STATS
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#ifndef LUACMSGPACK_STATS_CLOCK
+#define LUACMSGPACK_STATS_CLOCK() mp_stats_clock()
+
+static double mp_stats_clock(void) {
+#if defined(_WIN32)
+    LARGE_INTEGER f, c;
+
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    return (double)c.QuadPart/(double)f.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec+(double)ts.tv_nsec/1e9;
+#else
+    return (double)clock()/CLOCKS_PER_SEC;
+#endif
+}
+#endif
+
+typedef struct mp_stats {
+    uint64_t pack_calls, unpack_calls;
+    uint64_t bytes_out, bytes_in;
+    uint64_t reallocs;      /* Encoding buffer allocations and resizes. */
+    size_t peak_buffer;     /* Biggest encoding buffer allocated. */
+    int max_depth;          /* Max tables nesting, encoding or decoding. */
+    double pack_time, unpack_time;  /* Seconds, see LUACMSGPACK_STATS_CLOCK. */
+    uint64_t types[256];    /* Elements encoded, by first byte. */
+} mp_stats;
+
+#define mp_stats_depth(_st,_depth) do { \
+    if ((_st) && (_depth) > (_st)->max_depth) (_st)->max_depth = (_depth); \
+} while(0)
+
+#define mp_stats_type(_buf,_b) do { \
+    if ((_buf)->stats) (_buf)->stats->types[(unsigned char)(_b)]++; \
+} while(0)
+
+struct mp_buf;
+static void mp_stats_pack(mp_stats *st, const struct mp_buf *buf, double t0);
+static void mp_stats_unpack(mp_stats *st, size_t len, double t0);
+static void mp_stats_elements(struct mp_buf *buf, const unsigned char *p,
+                              size_t len, int add);
+#else
+#define mp_stats_depth(_st,_depth)
+#define mp_stats_type(_buf,_b)
+#define mp_stats_elements(_buf,_p,_len,_add)
+#endif
+
 /* ----------------------------- String buffer ----------------------------------
  * This is a simple implementation of string buffers. The only opereation
  * supported is creating empty buffers and appending bytes to it.
  * The string buffer uses 2x preallocation on every realloc for O(N) append
- * behavior.  */
+ * behavior.
+ *
+ * Memory is obtained from the allocator of the Lua state owning the buffer
+ * (see lua_getallocf), so that it is accounted like every other Lua object.
+ * If the allocator fails the buffer stops growing and 'err' is set, it is
+ * up to the caller to check it once the encoding is done. */
+
+#define MP_BUF_ERROR_NONE   0
+#define MP_BUF_ERROR_OOM    1   /* Allocator failure while growing. */
+#define MP_BUF_ERROR_DEPTH  2   /* Tables nested deeper than 'max_depth'. */
+#define MP_BUF_ERROR_CYCLE  3   /* Table cycle met in "strict" refs mode. */
+#define MP_BUF_ERROR_EXT    4   /* Ext encoder failure, see 'errmsg'. */
+
+/* How the encoder tracks the tables it meets, see mp_encode_lua_ref(). */
+#define MP_REFS_OFF         0   /* No tracking, only max_depth stops cycles. */
+#define MP_REFS_STRICT      1   /* Cycles are an error. */
+#define MP_REFS_DEDUPE      2   /* Tables met again are references. */
+
+/* The tables met are kept in an open addressing hash set keyed by the table
+ * pointer. A slot is used only if its 'gen' is the current one, so that
+ * the set is emptied for every object just incrementing 'gen'. */
+typedef struct mp_ref_slot {
+    const void *p;
+    unsigned int gen;
+    size_t val;         /* Reference id, or 1 if on the path in "strict". */
+} mp_ref_slot;
+
+typedef struct mp_refs {
+    mp_ref_slot *slots;
+    size_t cap, used;   /* 'cap' is a power of two. */
+    const void **ids;   /* Table of every reference id, NULL if unknown. */
+    size_t nids, idcap;
+    unsigned int gen;
+    int mode;
+} mp_refs;
 
 typedef struct mp_buf {
+    lua_Alloc alloc;
+    void *ud;
     unsigned char *b;
     size_t len, free;
+    int err;
+    int memo;       /* Frozen tables for the encoder, see mp_freeze(). */
+    int max_depth;  /* Max tables nesting for the encoder. */
+    int bin;        /* Encode strings as bin instead of str. */
+    int errmsg;     /* Registry reference of the MP_BUF_ERROR_EXT message. */
+    size_t mark;    /* Table walks hand back every value past this length. */
+    mp_refs refs;   /* Tables met by the encoder, if tracked. */
+#ifdef LUACMSGPACK_STATS
+    mp_stats *stats;    /* Counters of the owning codec, or NULL. */
+#endif
 } mp_buf;
 
-static mp_buf *mp_buf_new(void) {
-    mp_buf *buf = malloc(sizeof(*buf));
-    
+static void mp_buf_init(lua_State *L, mp_buf *buf) {
+    buf->alloc = lua_getallocf(L,&buf->ud);
     buf->b = NULL;
     buf->len = buf->free = 0;
-    return buf;
+    buf->err = MP_BUF_ERROR_NONE;
+    buf->memo = LUA_NOREF;
+    buf->max_depth = LUACMSGPACK_MAX_NESTING;
+    buf->bin = 0;
+    buf->errmsg = LUA_NOREF;
+    buf->mark = (size_t)-1;
+    memset(&buf->refs,0,sizeof(buf->refs));
+    buf->refs.mode = MP_REFS_OFF;
+#ifdef LUACMSGPACK_STATS
+    buf->stats = NULL;
+#endif
+}
+
+/* Resize the allocation to exactly 'size' bytes, that must be >= buf->len. */
+static int mp_buf_resize(mp_buf *buf, size_t size) {
+    size_t oldsize = buf->len+buf->free;
+    unsigned char *b;
+
+    if (size == oldsize) return 1;
+    b = buf->alloc(buf->ud,buf->b,oldsize,size);
+    if (b == NULL && size != 0) {
+        buf->err = MP_BUF_ERROR_OOM;
+        return 0;
+    }
+    buf->b = b;
+    buf->free = size-buf->len;
+#ifdef LUACMSGPACK_STATS
+    if (buf->stats && size) {
+        buf->stats->reallocs++;
+        if (size > buf->stats->peak_buffer) buf->stats->peak_buffer = size;
+    }
+#endif
+    return 1;
 }
 
 void mp_buf_append(mp_buf *buf, const unsigned char *s, size_t len) {
     if (buf->free < len) {
         size_t newlen = buf->len+len;
 
-        buf->b = realloc(buf->b,newlen*2);
-        buf->free = newlen;
+        if (!mp_buf_resize(buf,newlen*2)) return;
     }
     memcpy(buf->b+buf->len,s,len);
     buf->len += len;
     buf->free -= len;
 }
 
+static size_t mp_refs_hash(const void *p) {
+    size_t h = (size_t)(uintptr_t)p;
+
+    return (h ^ (h >> 16)) * 0x45d9f3b;
+}
+
+/* Return the slot of 'p', or the empty one where it should be added. */
+static mp_ref_slot *mp_refs_find(mp_refs *r, const void *p) {
+    size_t j = mp_refs_hash(p) & (r->cap-1);
+
+    while(r->slots[j].gen == r->gen && r->slots[j].p != p)
+        j = (j+1) & (r->cap-1);
+    return &r->slots[j];
+}
+
+/* Double the slots of the set, keeping only the ones in use. */
+static int mp_refs_grow(mp_buf *buf) {
+    mp_refs *r = &buf->refs;
+    mp_ref_slot *old = r->slots;
+    size_t oldcap = r->cap, j;
+
+    r->slots = buf->alloc(buf->ud,NULL,0,sizeof(*old)*(oldcap ? oldcap*2 : 64));
+    if (r->slots == NULL) {
+        r->slots = old;
+        buf->err = MP_BUF_ERROR_OOM;
+        return 0;
+    }
+    r->cap = oldcap ? oldcap*2 : 64;
+    memset(r->slots,0,sizeof(*old)*r->cap);
+    for (j = 0; j < oldcap; j++) {
+        if (old[j].gen == r->gen) *mp_refs_find(r,old[j].p) = old[j];
+    }
+    buf->alloc(buf->ud,old,sizeof(*old)*oldcap,0);
+    return 1;
+}
+
+/* Like mp_refs_find(), but making sure there is room to add 'p'. Returns
+ * NULL if out of memory. */
+static mp_ref_slot *mp_refs_slot(mp_buf *buf, const void *p) {
+    mp_refs *r = &buf->refs;
+
+    if ((r->used+1)*2 > r->cap && !mp_refs_grow(buf)) return NULL;
+    return mp_refs_find(r,p);
+}
+
+/* Assign the next reference id to the table 'p' (NULL for the tables of
+ * pre-packed fragments, that can't be referenced). */
+static int mp_refs_add_id(mp_buf *buf, const void *p) {
+    mp_refs *r = &buf->refs;
+
+    if (r->nids == r->idcap) {
+        size_t cap = r->idcap ? r->idcap*2 : 64;
+        void *ids = buf->alloc(buf->ud,(void*)r->ids,
+                               sizeof(*r->ids)*r->idcap,sizeof(*r->ids)*cap);
+
+        if (ids == NULL) {
+            buf->err = MP_BUF_ERROR_OOM;
+            return 0;
+        }
+        r->ids = ids;
+        r->idcap = cap;
+    }
+    r->ids[r->nids++] = p;
+    return 1;
+}
+
+/* Forget all the tables met, before encoding a new object. */
+static void mp_refs_reset(mp_buf *buf) {
+    mp_refs *r = &buf->refs;
+
+    if (++r->gen == 0) {
+        if (r->cap) memset(r->slots,0,sizeof(*r->slots)*r->cap);
+        r->gen = 1;
+    }
+    r->used = 0;
+    r->nids = 0;
+}
+
+static void mp_refs_free(mp_buf *buf) {
+    mp_refs *r = &buf->refs;
+
+    buf->alloc(buf->ud,r->slots,sizeof(*r->slots)*r->cap,0);
+    buf->alloc(buf->ud,(void*)r->ids,sizeof(*r->ids)*r->idcap,0);
+    r->slots = NULL;
+    r->ids = NULL;
+    r->cap = r->used = r->nids = r->idcap = 0;
+}
+
 void mp_buf_free(mp_buf *buf) {
-    free(buf->b);
-    free(buf);
+    buf->free += buf->len; /* So the allocator gets the real size. */
+    buf->len = 0;
+    mp_buf_resize(buf,0);
+    mp_refs_free(buf);
 }
 
 /* ------------------------------ String cursor ----------------------------------
  * This simple data structure is used for parsing. Basically you create a cursor
- * using a string pointer and a length, then it is possible to access the
- * current string position with cursor->p, check the remaining length
- * in cursor->left, and finally consume more string using
+ * (usually on the C stack, cursors are cheap) and initialize it with
+ * mp_cur_init() using a string pointer and a length, then it is possible to
+ * access the current string position with cursor->p, check the remaining
+ * length in cursor->left, and finally consume more string using
  * mp_cur_consume(cursor,len), to advance 'p' and subtract 'left'.
  * An additional field cursor->error is set to zero on initialization and can
  * be used to report errors. */
@@ -105,24 +439,60 @@ void mp_buf_free(mp_buf *buf) {
 #define MP_CUR_ERROR_NONE   0
 #define MP_CUR_ERROR_EOF    1   /* Not enough data to complete the opereation. */
 #define MP_CUR_ERROR_BADFMT 2   /* Bad data format */
+#define MP_CUR_ERROR_RANGE  3   /* Value not representable as a Lua type. */
+#define MP_CUR_ERROR_DEPTH  4   /* Nesting too deep to be followed. */
+
+/* What to do with MessagePack uint 64 values greater than the biggest
+ * lua_Integer (only possible with Lua >= 5.3, older versions always use
+ * lua_Number for integers). */
+#define MP_UINT64_FLOAT     0   /* Convert to lua_Number, may lose precision. */
+#define MP_UINT64_WRAP      1   /* Wrap around to negative, like Lua does. */
+#define MP_UINT64_ERROR     2   /* Fail with MP_CUR_ERROR_RANGE. */
+
+/* Codec options. Cursors point to the options of the codec they belong
+ * to, or to the defaults. */
+typedef struct mp_opts {
+    int uint64;
+    int max_depth;      /* Max tables nesting, both encoding and decoding. */
+    int refs;           /* Tables tracking, see mp_encode_lua_ref(). */
+    int strings;        /* MP_STRINGS_STR or MP_STRINGS_BIN. */
+} mp_opts;
+
+/* MessagePack type used to encode Lua strings. */
+#define MP_STRINGS_STR      0
+#define MP_STRINGS_BIN      1
+
+static const mp_opts mp_default_opts = {
+    MP_UINT64_FLOAT,            /* uint64 */
+    LUACMSGPACK_MAX_NESTING,    /* max_depth */
+    MP_REFS_OFF,                /* refs */
+    MP_STRINGS_STR              /* strings */
+};
 
 typedef struct mp_cur {
     const unsigned char *p;
     size_t left;
     int err;
+    const mp_opts *opts;
+    int src;    /* Stack index of a value anchoring 'p', 0 if none. */
+    size_t slice;   /* Min length of strings decoded as slices, 0 = none. */
+    int reuse;      /* Fill the table on top with the next array or map. */
+#ifdef LUACMSGPACK_STATS
+    mp_stats *stats;    /* Counters of the decoding codec, or NULL. */
+#endif
 } mp_cur;
 
-static mp_cur *mp_cur_new(const unsigned char *s, size_t len) {
-    mp_cur *cursor = malloc(sizeof(*cursor));
-
+static void mp_cur_init(mp_cur *cursor, const unsigned char *s, size_t len) {
     cursor->p = s;
     cursor->left = len;
     cursor->err = MP_CUR_ERROR_NONE;
-    return cursor;
-}
-
-static void mp_cur_free(mp_cur *cursor) {
-    free(cursor);
+    cursor->opts = &mp_default_opts;
+    cursor->src = 0;
+    cursor->slice = 0;
+    cursor->reuse = 0;
+#ifdef LUACMSGPACK_STATS
+    cursor->stats = NULL;
+#endif
 }
 
 #define mp_cur_consume(_c,_len) do { _c->p += _len; _c->left -= _len; } while(0)
@@ -137,167 +507,411 @@ static void mp_cur_free(mp_cur *cursor) {
     } \
 } while(0)
 
+/* ------------------------------- Codec instances -------------------------------
+ * A codec owns the encoding buffer and keeps it across calls, so that in the
+ * common case packing an object performs no allocation at all: the buffer is
+ * just rewound. Codecs are Lua userdata created by cmsgpack.new(), the
+ * module level pack/unpack functions use a default codec stored as upvalue.
+ *
+ * Since a burst of big objects would otherwise pin a big buffer forever,
+ * every 'shrink_after' calls the buffer is given back to the allocator if it
+ * is more than twice the size of the biggest object encoded in the meantime
+ * (and bigger than the initial capacity). */
+
+#define LUACMSGPACK_CODEC_MT        "cmsgpack.codec"
+#define LUACMSGPACK_BUFFER_SIZE     256  /* Default initial buffer capacity. */
+#define LUACMSGPACK_SHRINK_AFTER    1024 /* Default calls between shrinks. */
+
+typedef struct mp_codec {
+    mp_buf buf;
+    mp_opts opts;           /* Decoding options. */
+    size_t buffer_size;     /* Capacity the buffer never shrinks below. */
+    int shrink_after;       /* Calls between shrink checks, 0 = never. */
+    int calls;              /* Calls since the last shrink check. */
+    size_t peak;            /* Biggest output since the last shrink check. */
+    int busy;               /* Buffer in use, see mp_codec_acquire(). */
+    int memo;               /* Registry reference of the frozen tables. */
+#ifdef LUACMSGPACK_STATS
+    mp_stats stats;
+#endif
+} mp_codec;
+
+/* Create a new codec and push it on the stack. Options are copied from
+ * 'model', or set to the defaults if it is NULL. No buffer is allocated
+ * until the first encoding, see mp_codec_reserve(). */
+static mp_codec *mp_codec_new(lua_State *L, const mp_codec *model) {
+    mp_codec *codec = lua_newuserdata(L,sizeof(*codec));
+
+    if (model) {
+        *codec = *model;
+    } else {
+        codec->opts = mp_default_opts;
+        codec->buffer_size = LUACMSGPACK_BUFFER_SIZE;
+        codec->shrink_after = LUACMSGPACK_SHRINK_AFTER;
+    }
+    mp_buf_init(L,&codec->buf);
+    codec->calls = 0;
+    codec->peak = 0;
+    codec->busy = 0;
+    codec->memo = LUA_NOREF;
+#ifdef LUACMSGPACK_STATS
+    memset(&codec->stats,0,sizeof(codec->stats));
+    codec->buf.stats = &codec->stats;
+#endif
+    luaL_getmetatable(L,LUACMSGPACK_CODEC_MT);
+    lua_setmetatable(L,-2);
+    return codec;
+}
+
+/* Preallocate the initial buffer capacity. */
+static void mp_codec_reserve(mp_codec *codec) {
+    if (codec->buf.len+codec->buf.free < codec->buffer_size)
+        mp_buf_resize(&codec->buf,codec->buffer_size);
+}
+
+/* Module level functions carry the default codec as first upvalue, codec
+ * methods get it as first argument. */
+static mp_codec *mp_codec_get(lua_State *L) {
+    mp_codec *codec = lua_touserdata(L,lua_upvalueindex(1));
+
+    if (codec == NULL)
+        codec = luaL_checkudata(L,1,LUACMSGPACK_CODEC_MT);
+    return codec;
+}
+
+/* Stack index of the first argument following the codec, if any. */
+#define mp_codec_firstarg(L) \
+    (lua_touserdata(L,lua_upvalueindex(1)) != NULL ? 1 : 2)
+
+/* Get the codec buffer ready for a new encoding. A codec may be re-entered
+ * while busy (for instance by Lua code called while encoding), in that case a
+ * throwaway codec is pushed on the stack and used instead. */
+static mp_codec *mp_codec_acquire(lua_State *L, mp_codec *codec) {
+    int memo = codec->memo;
+
+    if (codec->busy) {
+        mp_codec *model = codec;
+
+        codec = mp_codec_new(L,model);
+        codec->shrink_after = 0;
+#ifdef LUACMSGPACK_STATS
+        codec->buf.stats = model->buf.stats; /* Count into the busy codec. */
+#endif
+    }
+    codec->busy = 1;
+    codec->buf.memo = memo;
+    codec->buf.max_depth = codec->opts.max_depth;
+    codec->buf.refs.mode = codec->opts.refs;
+    codec->buf.bin = codec->opts.strings == MP_STRINGS_BIN;
+    codec->buf.len += codec->buf.free;
+    codec->buf.free = codec->buf.len;
+    codec->buf.len = 0;
+    codec->buf.err = MP_BUF_ERROR_NONE;
+    return codec;
+}
+
+/* Called when the encoded buffer is no longer needed: apply the shrink
+ * policy and make the codec available again. */
+static void mp_codec_release(mp_codec *codec) {
+    mp_buf *buf = &codec->buf;
+
+    if (buf->len > codec->peak) codec->peak = buf->len;
+    if (codec->shrink_after && ++codec->calls >= codec->shrink_after) {
+        size_t keep = codec->peak > codec->buffer_size ?
+                      codec->peak : codec->buffer_size;
+
+        if (buf->len+buf->free > keep*2) {
+            buf->free += buf->len;
+            buf->len = 0;
+            mp_buf_resize(buf,keep);
+            mp_refs_free(buf);
+        }
+        codec->calls = 0;
+        codec->peak = 0;
+    }
+    codec->busy = 0;
+}
+
+/* Push the message of the encoding error of 'buf', and clear it. */
+static void mp_buf_pusherror(lua_State *L, mp_buf *buf) {
+    int err = buf->err;
+
+    buf->err = MP_BUF_ERROR_NONE;
+    if (err == MP_BUF_ERROR_DEPTH)
+        lua_pushstring(L,"Nesting too deep while encoding.");
+    else if (err == MP_BUF_ERROR_CYCLE)
+        lua_pushstring(L,"Table cycle while encoding.");
+    else if (err == MP_BUF_ERROR_EXT) {
+        lua_rawgeti(L,LUA_REGISTRYINDEX,buf->errmsg);
+        luaL_unref(L,LUA_REGISTRYINDEX,buf->errmsg);
+        buf->errmsg = LUA_NOREF;
+    } else
+        lua_pushstring(L,"Out of memory while encoding.");
+}
+
+/* Raise the error of the last encoding, if any, releasing the codec. */
+static void mp_codec_check(lua_State *L, mp_codec *codec) {
+    if (codec->buf.err == MP_BUF_ERROR_NONE) return;
+    mp_codec_release(codec);
+    mp_buf_pusherror(L,&codec->buf);
+    lua_error(L);
+}
+
+/* Call the C function 'fn' in protected mode with the 'nargs' values on top
+ * of the stack, like lua_pcall(). Lua 5.1 allocates a new closure for every
+ * lua_pushcfunction(), so there 'fn' is reached through a trampoline that
+ * luaopen_cmsgpack_core() stores once in the registry, getting a pointer
+ * to 'fn' that lives on the C stack for the duration of the call. */
+#if LUA_VERSION_NUM < 502
+typedef struct mp_cfunc {
+    lua_CFunction fn;
+} mp_cfunc;
+
+static char mp_trampoline_key;  /* Its address is the registry key. */
+
+static int mp_trampoline(lua_State *L) {
+    lua_CFunction fn = ((mp_cfunc*)lua_touserdata(L,1))->fn;
+
+    lua_remove(L,1);
+    return fn(L);
+}
+#endif
+
+static int mp_pcall(lua_State *L, lua_CFunction fn, int nargs, int nresults) {
+#if LUA_VERSION_NUM < 502
+    mp_cfunc f;
+
+    f.fn = fn;
+    lua_pushlightuserdata(L,&mp_trampoline_key);
+    lua_rawget(L,LUA_REGISTRYINDEX);
+    lua_insert(L,-(nargs+1));
+    lua_pushlightuserdata(L,&f);
+    lua_insert(L,-(nargs+1));
+    return lua_pcall(L,nargs+1,nresults,0);
+#else
+    lua_pushcfunction(L,fn);
+    lua_insert(L,-(nargs+1));
+    return lua_pcall(L,nargs,nresults,0);
+#endif
+}
+
+/* Encoding reports its own errors in buf->err, but Lua errors can still be
+ * raised in the middle of it (out of memory, or lua_next() on a table that
+ * a hook modified), that would skip mp_codec_release() and leave the codec
+ * busy forever. So the encoding runs in protected mode: 'fn' is called with
+ * the codec as light userdata followed by the 'nargs' values on top of the
+ * stack, that are popped, and leaves one result: nil if the encoding set an
+ * error. Lua errors release the codec and are raised again. */
+static void mp_codec_pcall(lua_State *L, mp_codec *codec, lua_CFunction fn,
+                           int nargs)
+{
+    lua_pushlightuserdata(L,codec);
+    lua_insert(L,-(nargs+1));
+    if (mp_pcall(L,fn,nargs+1,1) != 0) {
+        mp_codec_release(codec);
+        lua_error(L);
+    }
+}
+
 /* --------------------------- Low level MP encoding -------------------------- */
 
+/* Strings are encoded as str, or as bin if buf->bin is set. There is no
+ * fix bin type, so the smallest bin header is two bytes. */
 static void mp_encode_bytes(mp_buf *buf, const unsigned char *s, size_t len) {
     unsigned char hdr[5];
     int hdrlen;
 
-    if (len < 32) {
-        hdr[0] = 0xa0 | (len&0xff); /* fix raw */
+    if (len < 32 && !buf->bin) {
+        hdr[0] = 0xa0 | (len&0xff); /* fix str */
         hdrlen = 1;
+    } else if (len <= 0xff) {
+        hdr[0] = buf->bin ? 0xc4 : 0xd9; /* bin 8, str 8 */
+        hdr[1] = len&0xff;
+        hdrlen = 2;
     } else if (len <= 0xffff) {
-        hdr[0] = 0xda;
-        hdr[1] = (len&0xff00)>>8;
-        hdr[2] = len&0xff;
+        hdr[0] = buf->bin ? 0xc5 : 0xda; /* bin 16, str 16 */
+        mp_store16(hdr+1,(uint16_t)len);
         hdrlen = 3;
     } else {
-        hdr[0] = 0xdb;
-        hdr[1] = (len&0xff000000)>>24;
-        hdr[2] = (len&0xff0000)>>16;
-        hdr[3] = (len&0xff00)>>8;
-        hdr[4] = len&0xff;
+        hdr[0] = buf->bin ? 0xc6 : 0xdb; /* bin 32, str 32 */
+        mp_store32(hdr+1,(uint32_t)len);
         hdrlen = 5;
     }
+    mp_stats_type(buf,hdr[0]);
     mp_buf_append(buf,hdr,hdrlen);
     mp_buf_append(buf,s,len);
 }
 
+/* Numbers are generated into a caller provided array of at least
+ * MP_NUMBER_MAXLEN bytes, returning the number of bytes used, so that they
+ * can be written straight into the buffer (see mp_encode_lua_number). */
+#define MP_NUMBER_MAXLEN 9
+
 /* we assume IEEE 754 internal format for single and double precision floats. */
-static void mp_encode_double(mp_buf *buf, double d) {
-    unsigned char b[9];
+static int mp_double_bytes(unsigned char *b, double d) {
     float f = d;
+    uint32_t v32;
+    uint64_t v64;
 
     assert(sizeof(f) == 4 && sizeof(d) == 8);
     if (d == (double)f) {
         b[0] = 0xca;    /* float IEEE 754 */
-        memcpy(b+1,&f,4);
-        memrevifle(b+1,4);
-        mp_buf_append(buf,b,5);
-    } else if (sizeof(d) == 8) {
+        memcpy(&v32,&f,4);
+        mp_store32(b+1,v32);
+        return 5;
+    } else {
         b[0] = 0xcb;    /* double IEEE 754 */
-        memcpy(b+1,&d,8);
-        memrevifle(b+1,8);
-        mp_buf_append(buf,b,9);
+        memcpy(&v64,&d,8);
+        mp_store64(b+1,v64);
+        return 9;
     }
 }
 
-static void mp_encode_int(mp_buf *buf, int64_t n) {
-    unsigned char b[9];
-    int enclen;
-
+static int mp_int_bytes(unsigned char *b, int64_t n) {
     if (n >= 0) {
         if (n <= 127) {
             b[0] = n & 0x7f;    /* positive fixnum */
-            enclen = 1;
+            return 1;
         } else if (n <= 0xff) {
             b[0] = 0xcc;        /* uint 8 */
             b[1] = n & 0xff;
-            enclen = 2;
+            return 2;
         } else if (n <= 0xffff) {
             b[0] = 0xcd;        /* uint 16 */
-            b[1] = (n & 0xff00) >> 8;
-            b[2] = n & 0xff;
-            enclen = 3;
+            mp_store16(b+1,(uint16_t)n);
+            return 3;
         } else if (n <= 0xffffffffLL) {
             b[0] = 0xce;        /* uint 32 */
-            b[1] = (n & 0xff000000) >> 24;
-            b[2] = (n & 0xff0000) >> 16;
-            b[3] = (n & 0xff00) >> 8;
-            b[4] = n & 0xff;
-            enclen = 5;
+            mp_store32(b+1,(uint32_t)n);
+            return 5;
         } else {
             b[0] = 0xcf;        /* uint 64 */
-            b[1] = (n & 0xff00000000000000LL) >> 56;
-            b[2] = (n & 0xff000000000000LL) >> 48;
-            b[3] = (n & 0xff0000000000LL) >> 40;
-            b[4] = (n & 0xff00000000LL) >> 32;
-            b[5] = (n & 0xff000000) >> 24;
-            b[6] = (n & 0xff0000) >> 16;
-            b[7] = (n & 0xff00) >> 8;
-            b[8] = n & 0xff;
-            enclen = 9;
+            mp_store64(b+1,(uint64_t)n);
+            return 9;
         }
     } else {
         if (n >= -32) {
             b[0] = ((char)n);   /* negative fixnum */
-            enclen = 1;
+            return 1;
         } else if (n >= -128) {
             b[0] = 0xd0;        /* int 8 */
             b[1] = n & 0xff;
-            enclen = 2;
+            return 2;
         } else if (n >= -32768) {
             b[0] = 0xd1;        /* int 16 */
-            b[1] = (n & 0xff00) >> 8;
-            b[2] = n & 0xff;
-            enclen = 3;
+            mp_store16(b+1,(uint16_t)n);
+            return 3;
         } else if (n >= -2147483648LL) {
             b[0] = 0xd2;        /* int 32 */
-            b[1] = (n & 0xff000000) >> 24;
-            b[2] = (n & 0xff0000) >> 16;
-            b[3] = (n & 0xff00) >> 8;
-            b[4] = n & 0xff;
-            enclen = 5;
+            mp_store32(b+1,(uint32_t)n);
+            return 5;
         } else {
             b[0] = 0xd3;        /* int 64 */
-            b[1] = (n & 0xff00000000000000LL) >> 56;
-            b[2] = (n & 0xff000000000000LL) >> 48;
-            b[3] = (n & 0xff0000000000LL) >> 40;
-            b[4] = (n & 0xff00000000LL) >> 32;
-            b[5] = (n & 0xff000000) >> 24;
-            b[6] = (n & 0xff0000) >> 16;
-            b[7] = (n & 0xff00) >> 8;
-            b[8] = n & 0xff;
-            enclen = 9;
+            mp_store64(b+1,(uint64_t)n);
+            return 9;
         }
     }
-    mp_buf_append(buf,b,enclen);
 }
 
-static void mp_encode_array(mp_buf *buf, int64_t n) {
-    unsigned char b[5];
-    int enclen;
-
+/* Array and map headers are also written in place of a placeholder by the
+ * table encoder (see mp_encode_table_next), so they are generated into a
+ * caller provided array, returning the number of bytes used. */
+static int mp_array_header(unsigned char *b, int64_t n) {
     if (n <= 15) {
         b[0] = 0x90 | (n & 0xf);    /* fix array */
-        enclen = 1;
+        return 1;
     } else if (n <= 65535) {
         b[0] = 0xdc;                /* array 16 */
         b[1] = (n & 0xff00) >> 8;
         b[2] = n & 0xff;
-        enclen = 3;
+        return 3;
     } else {
         b[0] = 0xdd;                /* array 32 */
         b[1] = (n & 0xff000000) >> 24;
         b[2] = (n & 0xff0000) >> 16;
         b[3] = (n & 0xff00) >> 8;
         b[4] = n & 0xff;
-        enclen = 5;
+        return 5;
     }
-    mp_buf_append(buf,b,enclen);
 }
 
-static void mp_encode_map(mp_buf *buf, int64_t n) {
-    unsigned char b[5];
-    int enclen;
-
+static int mp_map_header(unsigned char *b, int64_t n) {
     if (n <= 15) {
         b[0] = 0x80 | (n & 0xf);    /* fix map */
-        enclen = 1;
+        return 1;
     } else if (n <= 65535) {
         b[0] = 0xde;                /* map 16 */
         b[1] = (n & 0xff00) >> 8;
         b[2] = n & 0xff;
-        enclen = 3;
+        return 3;
     } else {
         b[0] = 0xdf;                /* map 32 */
         b[1] = (n & 0xff000000) >> 24;
         b[2] = (n & 0xff0000) >> 16;
         b[3] = (n & 0xff00) >> 8;
         b[4] = n & 0xff;
-        enclen = 5;
+        return 5;
+    }
+}
+
+static void mp_encode_array(mp_buf *buf, int64_t n) {
+    unsigned char b[5];
+
+    mp_buf_append(buf,b,mp_array_header(b,n));
+    mp_stats_type(buf,b[0]);
+}
+
+static void mp_encode_map(mp_buf *buf, int64_t n) {
+    unsigned char b[5];
+
+    mp_buf_append(buf,b,mp_map_header(b,n));
+    mp_stats_type(buf,b[0]);
+}
+
+/* Ext headers, type included. Payloads of 1, 2, 4, 8 and 16 bytes use the
+ * fix ext formats. */
+static int mp_ext_header(unsigned char *b, size_t len, int type) {
+    int hdrlen;
+
+    switch(len) {
+    case 1: b[0] = 0xd4; hdrlen = 2; break;     /* fix ext 1 */
+    case 2: b[0] = 0xd5; hdrlen = 2; break;     /* fix ext 2 */
+    case 4: b[0] = 0xd6; hdrlen = 2; break;     /* fix ext 4 */
+    case 8: b[0] = 0xd7; hdrlen = 2; break;     /* fix ext 8 */
+    case 16: b[0] = 0xd8; hdrlen = 2; break;    /* fix ext 16 */
+    default:
+        if (len <= 0xff) {
+            b[0] = 0xc7;                        /* ext 8 */
+            b[1] = len & 0xff;
+            hdrlen = 3;
+        } else if (len <= 0xffff) {
+            b[0] = 0xc8;                        /* ext 16 */
+            mp_store16(b+1,(uint16_t)len);
+            hdrlen = 4;
+        } else {
+            b[0] = 0xc9;                        /* ext 32 */
+            mp_store32(b+1,(uint32_t)len);
+            hdrlen = 6;
+        }
+    }
+    b[hdrlen-1] = type & 0xff;
+    return hdrlen;
+}
+
+/* A reference to the table with the given id, as the smallest fixext that
+ * can hold it, big endian. */
+static void mp_encode_ref(mp_buf *buf, uint64_t id) {
+    unsigned char b[10];
+    int hdrlen, l, j;
+
+    l = id <= 0xff ? 1 : id <= 0xffff ? 2 : id <= 0xffffffffU ? 4 : 8;
+    hdrlen = mp_ext_header(b,l,LUACMSGPACK_REF_EXT);
+    for (j = l-1; j >= 0; j--) {
+        b[hdrlen+j] = id & 0xff;
+        id >>= 8;
     }
-    mp_buf_append(buf,b,enclen);
+    mp_buf_append(buf,b,hdrlen+l);
+    mp_stats_type(buf,b[0]);
 }
 
 /* ----------------------------- Lua types encoding --------------------------- */
@@ -313,401 +927,4197 @@ static void mp_encode_lua_string(lua_State *L, mp_buf *buf) {
 static void mp_encode_lua_bool(lua_State *L, mp_buf *buf) {
     unsigned char b = lua_toboolean(L,-1) ? 0xc3 : 0xc2;
     mp_buf_append(buf,&b,1);
+    mp_stats_type(buf,b);
 }
 
+/* Lua numbers are encoded as integers if they have an integral value that
+ * fits an int64, otherwise as float or double. With Lua >= 5.3 integers
+ * are encoded directly, without any floating point operation. */
+/* Numbers are written in place when there is room for any of them, since
+ * they are by far the most common elements of big arrays. */
 static void mp_encode_lua_number(lua_State *L, mp_buf *buf) {
-    lua_Number n = lua_tonumber(L,-1);
+    unsigned char tmp[MP_NUMBER_MAXLEN], *b;
+    lua_Number n;
+    int len;
 
-    if (floor(n) != n) {
-        mp_encode_double(buf,(double)n);
+    b = buf->free >= MP_NUMBER_MAXLEN ? buf->b+buf->len : tmp;
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L,-1)) {
+        len = mp_int_bytes(b,(int64_t)lua_tointeger(L,-1));
+    } else
+#endif
+    {
+        n = lua_tonumber(L,-1);
+        if (floor(n) == n &&
+            n >= -9223372036854775808.0 && n < 9223372036854775808.0)
+        {
+            len = mp_int_bytes(b,(int64_t)n);
+        } else {
+            len = mp_double_bytes(b,(double)n);
+        }
+    }
+    mp_stats_type(buf,b[0]);
+    if (b == tmp) {
+        mp_buf_append(buf,tmp,len);
     } else {
-        mp_encode_int(buf,(int64_t)n);
+        buf->len += len;
+        buf->free -= len;
     }
 }
 
-static void mp_encode_lua_type(lua_State *L, mp_buf *buf, int level);
+static int mp_encode_lua_frozen(lua_State *L, mp_buf *buf);
+static void mp_encode_lua_userdata(lua_State *L, mp_buf *buf);
 
-/* Convert a lua table into a message pack list. */
-static void mp_encode_lua_table_as_array(lua_State *L, mp_buf *buf, int level) {
-#if LUA_VERSION_NUM < 502
-    size_t len = lua_objlen(L,-1), j;
-#else
-    size_t len = lua_rawlen(L,-1), j;
-#endif
+static void mp_encode_lua_null(lua_State *L, mp_buf *buf) {
+    unsigned char b[1];
 
-    mp_encode_array(buf,len);
-    for (j = 1; j <= len; j++) {
-        lua_pushnumber(L,j);
-        lua_gettable(L,-2);
-        mp_encode_lua_type(L,buf,level+1);
-    }
+    b[0] = 0xc0;
+    mp_buf_append(buf,b,1);
+    mp_stats_type(buf,b[0]);
 }
 
-/* Convert a lua table into a message pack key-value map. */
-static void mp_encode_lua_table_as_map(lua_State *L, mp_buf *buf, int level) {
-    size_t len = 0;
-
-    /* First step: count keys into table. No other way to do it with the
-     * Lua API, we need to iterate a first time. Note that an alternative
-     * would be to do a single run, and then hack the buffer to insert the
-     * map opcodes for message pack. Too hachish for this lib. */
-    lua_pushnil(L);
-    while(lua_next(L,-2)) {
-        lua_pop(L,1); /* remove value, keep key for next iteration. */
-        len++;
-    }
+/* Replace the one byte placeholder at 'pos', reserved before emitting the
+ * elements of a container, with the real header. Headers longer than the
+ * placeholder require the body to be moved forward. */
+static void mp_buf_patch_header(mp_buf *buf, size_t pos,
+                                const unsigned char *hdr, int hdrlen)
+{
+    size_t body = buf->len-pos-1;
 
-    /* Step two: actually encoding of the map. */
-    mp_encode_map(buf,len);
-    lua_pushnil(L);
-    while(lua_next(L,-2)) {
-        /* Stack: ... key value */
-        lua_pushvalue(L,-2); /* Stack: ... key value key */
-        mp_encode_lua_type(L,buf,level+1); /* encode key */
-        mp_encode_lua_type(L,buf,level+1); /* encode val */
+    if (buf->err) return;
+    mp_stats_type(buf,hdr[0]);
+    if (hdrlen > 1) {
+        mp_buf_append(buf,hdr,hdrlen-1); /* Make room, content is rewritten. */
+        if (buf->err) return;
+        memmove(buf->b+pos+hdrlen,buf->b+pos+1,body);
     }
+    memcpy(buf->b+pos,hdr,hdrlen);
 }
 
-/* Returns true if the Lua table on top of the stack is exclusively composed
- * of keys from numerical keys from 1 up to N, with N being the total number
- * of elements, without any hole in the middle. */
-static int table_is_an_array(lua_State *L) {
-    long count = 0, idx = 0;
-    lua_Number n;
-
-    lua_pushnil(L);
-    while(lua_next(L,-2)) {
-        /* Stack: ... key value */
-        lua_pop(L,1); /* Stack: ... key */
-        if (lua_type(L,-1) != LUA_TNUMBER) goto not_array;
-        n = lua_tonumber(L,-1);
-        idx = n;
-        if (idx != n || idx < 1) goto not_array;
-        count++;
-    }
-    /* We have the total number of elements in "count". Also we have
-     * the max index encountered in "idx". We can't reach this code
-     * if there are indexes <= 0. If you also note that there can not be
-     * repeated keys into a table, you have that if idx==count you are sure
-     * that there are all the keys form 1 to count (both included). */
-    return idx == count;
-
-not_array:
-    lua_pop(L,1);
+/* Return the stack index up to which there is room, asking for 'want'
+ * slots more, so that the walk does not need to ask again soon, or for at
+ * least 'need' when that fails: Lua 5.1 gives C functions 8000 slots at
+ * most. Returns 0 if not even 'need' slots are available. */
+static int mp_stack_room(lua_State *L, int want, int need) {
+    if (lua_checkstack(L,want)) return lua_gettop(L)+want;
+    if (lua_checkstack(L,need)) return lua_gettop(L)+need;
     return 0;
 }
 
-/* If the length operator returns non-zero, that is, there is at least
- * an object at key '1', we serialize to message pack list. Otherwise
- * we use a map. */
-static void mp_encode_lua_table(lua_State *L, mp_buf *buf, int level) {
-    if (table_is_an_array(L))
-        mp_encode_lua_table_as_array(L,buf,level);
+/* Both the encoder and the decoder walk nested tables with an explicit work
+ * stack of frames, one for every table being visited, instead of C
+ * recursion. The first frames live on the C stack, deeper nesting moves
+ * them to a userdata, so that they are collected even if a Lua error is
+ * raised in the middle of the walk. The userdata is anchored at the stack
+ * index 'anchor', below everything the walk pushes: the walk only uses
+ * indexes relative to the top, so inserting it does not disturb it. */
+static void *mp_frames_grow(lua_State *L, void *frames, size_t size,
+                            int *cap, int anchor, int inline_frames)
+{
+    void *nf = lua_newuserdata(L,size*(*cap)*2);
+
+    memcpy(nf,frames,size*(*cap));
+    if (inline_frames)
+        lua_insert(L,anchor);
     else
-        mp_encode_lua_table_as_map(L,buf,level);
+        lua_replace(L,anchor);
+    *cap *= 2;
+    return nf;
 }
 
-static void mp_encode_lua_null(lua_State *L, mp_buf *buf) {
-    unsigned char b[1];
-
-    b[0] = 0xc0;
-    mp_buf_append(buf,b,1);
-}
+/* ---------------------------------------------------------------------------
+ * Tables references.
+ *
+ * With the 'refs' codec option the encoder records the tables it meets in
+ * buf->refs, starting again for every top level object. In "strict" mode
+ * meeting again a table that is still being encoded (a cycle) stops the
+ * encoding with MP_BUF_ERROR_CYCLE, while tables shared by different
+ * branches are just encoded every time.
+ *
+ * In "dedupe" mode every table gets an id, and when a table is met again
+ * only a reference to it is emitted: a fixext of type LUACMSGPACK_REF_EXT
+ * with the id as payload. Ids are assigned in the same order the decoder
+ * creates the tables, so the arrays and maps inside pre-packed fragments
+ * count as well (with no table to refer). A decoder in "dedupe" mode keeps
+ * all the tables it creates in order to resolve the references, so that
+ * the shared structure, cycles included, is rebuilt. */
 
-static void mp_encode_lua_type(lua_State *L, mp_buf *buf, int level) {
-    int t = lua_type(L,-1);
+/* Check the table on top of the stack against the tables already met and
+ * record it. Returns 1 if it was encoded as a reference or an error was
+ * set, otherwise 0 and the caller must encode it. */
+static int mp_encode_lua_ref(lua_State *L, mp_buf *buf) {
+    const void *p = lua_topointer(L,-1);
+    mp_refs *r = &buf->refs;
+    mp_ref_slot *slot = mp_refs_slot(buf,p);
 
-    /* Limit the encoding of nested tables to a specfiied maximum depth, so that
-     * we survive when called against circular references in tables. */
-    if (t == LUA_TTABLE && level == LUACMSGPACK_MAX_NESTING) t = LUA_TNIL;
-    switch(t) {
-    case LUA_TSTRING: mp_encode_lua_string(L,buf); break;
-    case LUA_TBOOLEAN: mp_encode_lua_bool(L,buf); break;
-    case LUA_TNUMBER: mp_encode_lua_number(L,buf); break;
-    case LUA_TTABLE: mp_encode_lua_table(L,buf,level); break;
-    default: mp_encode_lua_null(L,buf); break;
+    if (slot == NULL) return 1;
+    if (slot->gen != r->gen) {
+        slot->p = p;
+        slot->gen = r->gen;
+        r->used++;
+    } else if (r->mode == MP_REFS_STRICT) {
+        if (slot->val) {
+            buf->err = MP_BUF_ERROR_CYCLE;
+            return 1;
+        }
+    } else if (slot->val < r->nids && r->ids[slot->val] == p) {
+        mp_encode_ref(buf,slot->val);
+        return 1;
     }
-    lua_pop(L,1);
+    if (r->mode == MP_REFS_STRICT) {
+        slot->val = 1; /* On the path until mp_encode_ref_done(). */
+        return 0;
+    }
+    slot->val = r->nids;
+    return !mp_refs_add_id(buf,p);
 }
 
-static int mp_pack(lua_State *L) {
-    mp_buf *buf = mp_buf_new();
+/* The table 'p' was encoded, so it is no longer on the path. */
+static void mp_encode_ref_done(mp_buf *buf, const void *p) {
+    if (buf->refs.mode == MP_REFS_STRICT)
+        mp_refs_find(&buf->refs,p)->val = 0;
+}
 
-    mp_encode_lua_type(L,buf,0);
-    lua_pushlstring(L,(char*)buf->b,buf->len);
-    mp_buf_free(buf);
-    return 1;
+/* Account for the arrays and maps of a pre-packed fragment just copied
+ * into the output, but the first 'known' ones. Fragments are valid, and
+ * their elements are in the order the decoder meets them, so they are
+ * just visited one after the other. */
+static int mp_scan_element(const unsigned char *p, size_t left, size_t *len,
+                           uint64_t *count);
+
+static void mp_encode_ref_skip(mp_buf *buf, const unsigned char *p,
+                               size_t len, int known)
+{
+    size_t off = 0, elen;
+    uint64_t count;
+
+    if (buf->refs.mode != MP_REFS_DEDUPE) return;
+    while(off < len && mp_scan_element(p+off,len-off,&elen,&count) ==
+          MP_CUR_ERROR_NONE)
+    {
+        if ((p[off] & 0xe0) == 0x80 || (p[off] >= 0xdc && p[off] <= 0xdf)) {
+            if (known) known--;
+            else if (!mp_refs_add_id(buf,NULL)) return;
+        }
+        off += elen;
+    }
 }
 
-/* --------------------------------- Decoding --------------------------------- */
+/* ---------------------------------------------------------------------------
+ * Tables encoding.
+ *
+ * A table is converted into a message pack list only if its keys are
+ * exactly the integers from 1 to N, otherwise it is converted into a map.
+ * Since the number of elements is not known in advance, a single byte is
+ * reserved for the header, that is patched when the traversal is done.
+ *
+ * As long as lua_next() returns the keys 1, 2, 3, ... in order (that is the
+ * case for tables with only the array part populated) we optimistically
+ * emit just the values. The first time a different key shows up the body
+ * is discarded and the traversal restarts emitting key/value pairs. Keys
+ * that are 1..N but are not returned in order (for instance because some
+ * are stored in the hash part) are detected during the map traversal, and
+ * the table is encoded again as a list in this uncommon case, fetching
+ * the elements with raw accesses (since all the keys are present
+ * metamethods would never be called).
+ *
+ * Before starting, the border returned by the length operator is used to
+ * probe the table: if lua_next() finds more keys after it the table is
+ * not a list, or at best a list with keys out of order, so the optimistic
+ * pass (that would be thrown away) is skipped. Note that the opposite is
+ * not true, no keys after the border does not prove there are no other
+ * keys before it, so this can't replace the traversal.
+ *
+ * Every table being encoded has a frame with the state of its traversal,
+ * while the table itself, and the last key returned by lua_next(), are on
+ * the Lua stack. */
 
-void mp_decode_to_lua_type(lua_State *L, mp_cur *c);
+#define MP_ENC_ARRAY    0   /* Optimistic traversal, values only. */
+#define MP_ENC_MAP      1   /* Traversal emitting key/value pairs. */
+#define MP_ENC_MAPVAL   2   /* Key emitted, the value is on the stack. */
+#define MP_ENC_LIST     3   /* Elements 1..len with raw accesses. */
 
-void mp_decode_to_lua_array(lua_State *L, mp_cur *c, size_t len) {
-    int index = 1;
+typedef struct mp_enc_frame {
+    size_t pos;         /* Header placeholder. */
+    size_t count;       /* Elements, or pairs, emitted so far. */
+    lua_Number maxidx;  /* Max integer key seen, while 'is_seq'. */
+    int state;
+    int is_seq;         /* All the keys seen so far are integers >= 1. */
+    const void *table;
+    size_t nids;        /* Reference ids assigned before the elements. */
+} mp_enc_frame;
 
-    lua_newtable(L);
-    while(len--) {
-        lua_pushnumber(L,index++);
-        mp_decode_to_lua_type(L,c);
-        if (c->err) return;
-        lua_settable(L,-3);
+/* Start the traversal of the table on top of the stack. */
+static void mp_encode_table_begin(lua_State *L, mp_buf *buf, mp_enc_frame *f) {
+    unsigned char hdr[1];
+#if LUA_VERSION_NUM < 502
+    size_t len = lua_objlen(L,-1);
+#else
+    size_t len = lua_rawlen(L,-1);
+#endif
+
+    f->pos = buf->len;
+    f->count = 0;
+    f->maxidx = 0;
+    f->state = MP_ENC_ARRAY;
+    f->is_seq = 1;
+    f->table = lua_topointer(L,-1);
+    f->nids = buf->refs.nids;
+    if (len != 0) {
+        lua_pushinteger(L,len);
+        if (lua_next(L,-2)) {
+            lua_pop(L,2);
+            f->state = MP_ENC_MAP;
+        }
     }
+    mp_buf_append(buf,hdr,1); /* Header placeholder. */
+    lua_pushnil(L);
 }
 
-void mp_decode_to_lua_hash(lua_State *L, mp_cur *c, size_t len) {
-    lua_newtable(L);
-    while(len--) {
-        mp_decode_to_lua_type(L,c); /* key */
+/* Advance the traversal of the table of the frame 'f'. Returns 1 when the
+ * next value to encode was pushed on the stack, or 0 when the table is
+ * done: then the header is in place and the table was popped. */
+static int mp_encode_table_next(lua_State *L, mp_buf *buf, mp_enc_frame *f) {
+    unsigned char hdr[5];
+    lua_Number n;
+
+    for (;;) {
+        switch(f->state) {
+        case MP_ENC_LIST:
+            while(f->count < (size_t)f->maxidx) {
+                lua_rawgeti(L,-1,++f->count);
+                if (lua_type(L,-1) != LUA_TNUMBER || buf->len >= buf->mark)
+                    return 1;
+                mp_encode_lua_number(L,buf);
+                lua_pop(L,1);
+            }
+            lua_pop(L,1);
+            return 0;
+        case MP_ENC_MAPVAL:
+            /* Stack: ... table key value, the key was emitted. */
+            f->state = MP_ENC_MAP;
+            return 1;
+        }
+
+        /* Stack: ... table key */
+        if (!lua_next(L,-2)) break;
+        /* Stack: ... table key value */
+        if (f->state == MP_ENC_ARRAY) {
+            if (lua_type(L,-2) == LUA_TNUMBER &&
+                lua_tonumber(L,-2) == (lua_Number)(f->count+1))
+            {
+                f->count++;
+                if (lua_type(L,-1) != LUA_TNUMBER || buf->len >= buf->mark)
+                    return 1;
+                /* Numbers are emitted here, without going back to the
+                 * caller, so that arrays of numbers take a single loop,
+                 * unless a resumable job wants to stop at buf->mark. */
+                mp_encode_lua_number(L,buf);
+                lua_pop(L,1);
+                continue;
+            }
+            /* Not a list, restart the traversal emitting pairs. */
+            lua_pop(L,2);
+            lua_pushnil(L);
+            mp_stats_elements(buf,buf->b+f->pos+1,buf->len-(f->pos+1),0);
+            buf->free += buf->len-(f->pos+1);
+            buf->len = f->pos+1;
+            buf->refs.nids = f->nids;
+            f->state = MP_ENC_MAP;
+            f->count = 0;
+            continue;
+        }
+        if (f->is_seq) {
+            if (lua_type(L,-2) != LUA_TNUMBER) {
+                f->is_seq = 0;
+            } else {
+                n = lua_tonumber(L,-2);
+                if (n < 1 || floor(n) != n) f->is_seq = 0;
+                else if (n > f->maxidx) f->maxidx = n;
+            }
+        }
+        lua_pushvalue(L,-2); /* Stack: ... table key value key */
+        f->count++;
+        f->state = MP_ENC_MAPVAL;
+        return 1;
+    }
+
+    /* Traversal done. Stack: ... table */
+    if (f->state == MP_ENC_ARRAY) {
+        mp_buf_patch_header(buf,f->pos,hdr,mp_array_header(hdr,f->count));
+    } else if (f->is_seq && f->maxidx == (lua_Number)f->count) {
+        /* There can not be repeated keys into a table, so if the max index
+         * equals the number of keys all the keys from 1 to count are
+         * present: this is a list after all. */
+        mp_stats_elements(buf,buf->b+f->pos+1,buf->len-(f->pos+1),0);
+        buf->free += buf->len-f->pos;
+        buf->len = f->pos;
+        buf->refs.nids = f->nids;
+        mp_encode_array(buf,f->count);
+        f->state = MP_ENC_LIST;
+        f->count = 0;
+        return mp_encode_table_next(L,buf,f);
+    } else {
+        mp_buf_patch_header(buf,f->pos,hdr,mp_map_header(hdr,f->count));
+    }
+    lua_pop(L,1);
+    return 0;
+}
+
+/* Encode the value on top of the stack and pop it. 'depth' is the number of
+ * tables the value is nested into. Tables nested more than buf->max_depth
+ * levels stop the encoding with MP_BUF_ERROR_DEPTH. Encoding errors are
+ * reported in buf->err, only Lua errors such as out of memory are raised
+ * (codecs guard against them with mp_codec_pcall()). */
+static void mp_encode_lua_type(lua_State *L, mp_buf *buf, int depth) {
+    mp_enc_frame inline_frames[LUACMSGPACK_INLINE_FRAMES];
+    mp_enc_frame *frames = inline_frames;
+    int base = lua_gettop(L), cap = LUACMSGPACK_INLINE_FRAMES, top = 0;
+    int room = 0;
+
+    if (depth == 0 && buf->refs.mode != MP_REFS_OFF) mp_refs_reset(buf);
+    for (;;) {
+        /* Emit the value on top of the stack, tables just get a frame. */
+        switch(lua_type(L,-1)) {
+        case LUA_TSTRING: mp_encode_lua_string(L,buf); break;
+        case LUA_TBOOLEAN: mp_encode_lua_bool(L,buf); break;
+        case LUA_TNUMBER: mp_encode_lua_number(L,buf); break;
+        case LUA_TUSERDATA: mp_encode_lua_userdata(L,buf); break;
+        case LUA_TTABLE:
+            if (buf->refs.mode != MP_REFS_OFF && mp_encode_lua_ref(L,buf)) {
+                if (buf->err) {
+                    lua_settop(L,base-1);
+                    return;
+                }
+                break;
+            }
+            if (buf->memo != LUA_NOREF && mp_encode_lua_frozen(L,buf)) {
+                mp_encode_ref_done(buf,lua_topointer(L,-1));
+                break;
+            }
+            if (depth+top >= buf->max_depth) {
+                buf->err = MP_BUF_ERROR_DEPTH;
+                lua_settop(L,base-1);
+                return;
+            }
+            /* Every frame takes two stack slots, check them in bulk. */
+            if (lua_gettop(L)+8 > room &&
+                (room = mp_stack_room(L,16+top*2,8)) == 0)
+            {
+                buf->err = MP_BUF_ERROR_DEPTH;
+                lua_settop(L,base-1);
+                return;
+            }
+            if (top == cap) {
+                frames = mp_frames_grow(L,frames,sizeof(*frames),&cap,base,
+                                        frames == inline_frames);
+            }
+            mp_stats_depth(buf->stats,depth+top+1);
+            mp_encode_table_begin(L,buf,&frames[top++]);
+            goto next;
+        default: mp_encode_lua_null(L,buf); break;
+        }
+        lua_pop(L,1);
+
+next:   /* Find the next value to emit, closing the finished tables. */
+        while(top && !mp_encode_table_next(L,buf,&frames[top-1])) {
+            top--;
+            mp_encode_ref_done(buf,frames[top].table);
+        }
+        if (top == 0) break;
+    }
+    lua_settop(L,base-1);
+}
+
+/* Protected part of pack(), see mp_codec_pcall(). */
+static int mp_pack_encode(lua_State *L) {
+    mp_buf *buf = &((mp_codec*)lua_touserdata(L,1))->buf;
+    int nargs = lua_gettop(L), j;
+
+    for (j = 2; j <= nargs && !buf->err; j++) {
+        lua_pushvalue(L,j);
+        mp_encode_lua_type(L,buf,0);
+    }
+    if (buf->err) return 0;
+    lua_pushlstring(L,(char*)buf->b,buf->len);
+    return 1;
+}
+
+/* cmsgpack.pack(obj1, obj2, ...) -- Encode all the arguments, one after
+ * the other, into a single string. */
+static int mp_pack(lua_State *L) {
+    int first = mp_codec_firstarg(L), nargs = lua_gettop(L), j;
+    mp_codec *codec;
+#ifdef LUACMSGPACK_STATS
+    double t0 = LUACMSGPACK_STATS_CLOCK();
+#endif
+
+    if (nargs < first) {
+        lua_pushstring(L,"MessagePack pack needs input.");
+        lua_error(L);
+    }
+    codec = mp_codec_acquire(L,mp_codec_get(L));
+    for (j = first; j <= nargs; j++) lua_pushvalue(L,j);
+    mp_codec_pcall(L,codec,mp_pack_encode,nargs-first+1);
+    mp_codec_check(L,codec);
+#ifdef LUACMSGPACK_STATS
+    mp_stats_pack(codec->buf.stats,&codec->buf,t0);
+#endif
+    mp_codec_release(codec);
+    return 1;
+}
+
+/* ----------------------------- Compiled encoders ------------------------------
+ * cmsgpack.compile(keys) returns a function encoding records with a fixed
+ * set of fields, such as {ts=..., host=..., value=...} compiled from
+ * {"ts","host","value"}. The keys are encoded once at compile time, so
+ * encoding a record just requires a raw get for every key, copying the
+ * pre-encoded key, and encoding the value. Records with fields not in the
+ * template are found counting the keys of the record, stopping as soon as
+ * there are more than the fields encoded, and fall back to the generic
+ * encoder. Templates compiled with {trusted=true} skip the check, and just
+ * encode the template fields.
+ *
+ * The function has three upvalues: the codec whose buffer is used, the
+ * table of the keys, and an mp_template with the encoded keys. */
+
+#define LUACMSGPACK_TEMPLATE_MT "cmsgpack.template"
+
+typedef struct mp_template {
+    mp_buf keys;            /* The encoded keys, one after the other. */
+    int nkeys;
+    int trusted;            /* Records have no keys but the template ones. */
+    size_t off[1];          /* Offset of every key in 'keys', plus the end. */
+} mp_template;
+
+/* Encode the record at 'idx' into 'buf' with the template. If the record
+ * is not a table, or it has keys not in the template, the generic encoder
+ * is used. Fields that are nil are just omitted. */
+static void mp_template_encode(lua_State *L, mp_buf *buf, int idx,
+                               const mp_template *tpl, int keys)
+{
+    size_t pos = buf->len;
+    int j, present = 0, total = 0;
+    unsigned char hdr[5];
+
+    if (lua_type(L,idx) == LUA_TTABLE && buf->max_depth > 0 &&
+        buf->refs.mode == MP_REFS_OFF)
+    {
+        mp_buf_append(buf,hdr,1); /* Placeholder, patched later. */
+        for (j = 0; j < tpl->nkeys; j++) {
+            lua_rawgeti(L,keys,j+1);
+            lua_rawget(L,idx);
+            if (lua_isnil(L,-1)) {
+                lua_pop(L,1);
+                continue;
+            }
+            present++;
+            mp_buf_append(buf,tpl->keys.b+tpl->off[j],tpl->off[j+1]-tpl->off[j]);
+            mp_stats_type(buf,tpl->keys.b[tpl->off[j]]);
+            mp_encode_lua_type(L,buf,1);
+        }
+        /* All the keys are template fields if there are no more than
+         * the fields found. */
+        if (!tpl->trusted) {
+            lua_pushnil(L);
+            while(lua_next(L,idx)) {
+                lua_pop(L,1);
+                if (++total > present) {
+                    lua_pop(L,1);
+                    break;
+                }
+            }
+        }
+        if (total <= present) {
+            mp_buf_patch_header(buf,pos,hdr,mp_map_header(hdr,present));
+            return;
+        }
+        /* Some key is not in the template: start again. */
+        mp_stats_elements(buf,buf->b+pos+1,buf->len-(pos+1),0);
+        buf->free += buf->len-pos;
+        buf->len = pos;
+    }
+    lua_pushvalue(L,idx);
+    mp_encode_lua_type(L,buf,0);
+}
+
+/* Protected part of the function returned by compile(), called with the
+ * template, the record and the keys, see mp_codec_pcall(). */
+static int mp_template_pack_encode(lua_State *L) {
+    mp_buf *buf = &((mp_codec*)lua_touserdata(L,1))->buf;
+
+    mp_template_encode(L,buf,3,lua_touserdata(L,2),4);
+    if (buf->err) return 0;
+    lua_pushlstring(L,(char*)buf->b,buf->len);
+    return 1;
+}
+
+/* The function returned by compile(). */
+static int mp_template_pack(lua_State *L) {
+    mp_codec *codec = lua_touserdata(L,lua_upvalueindex(1));
+
+    luaL_checkany(L,1);
+    lua_settop(L,1);
+    codec = mp_codec_acquire(L,codec);
+    lua_pushvalue(L,lua_upvalueindex(3));
+    lua_pushvalue(L,1);
+    lua_pushvalue(L,lua_upvalueindex(2));
+    mp_codec_pcall(L,codec,mp_template_pack_encode,3);
+    mp_codec_check(L,codec);
+    mp_codec_release(codec);
+    return 1;
+}
+
+/* cmsgpack.compile(keys [, opts]) / codec:compile(keys [, opts]) -- Keys
+ * must be strings or numbers, without duplicates. The only option is
+ * 'trusted', to skip checking records for fields not in the template. */
+static int mp_compile(lua_State *L) {
+    int arg = mp_codec_firstarg(L), j, n, t, trusted = 0;
+    mp_template *tpl;
+
+    luaL_checktype(L,arg,LUA_TTABLE);
+    if (!lua_isnoneornil(L,arg+1)) {
+        luaL_checktype(L,arg+1,LUA_TTABLE);
+        lua_getfield(L,arg+1,"trusted");
+        trusted = lua_toboolean(L,-1);
+    }
+    lua_settop(L,arg);
+#if LUA_VERSION_NUM < 502
+    n = (int)lua_objlen(L,arg);
+#else
+    n = (int)lua_rawlen(L,arg);
+#endif
+    if (arg == 1)
+        lua_pushvalue(L,lua_upvalueindex(1));
+    else
+        lua_pushvalue(L,1);
+    lua_createtable(L,n,0);
+    tpl = lua_newuserdata(L,sizeof(*tpl)+n*sizeof(size_t));
+    mp_buf_init(L,&tpl->keys);
+    tpl->keys.bin = mp_codec_get(L)->opts.strings == MP_STRINGS_BIN;
+    tpl->nkeys = n;
+    tpl->trusted = trusted;
+    luaL_getmetatable(L,LUACMSGPACK_TEMPLATE_MT);
+    lua_setmetatable(L,-2);
+    lua_createtable(L,0,n); /* Keys seen so far. */
+    for (j = 0; j < n; j++) {
+        lua_rawgeti(L,arg,j+1);
+        t = lua_type(L,-1);
+        if ((t != LUA_TSTRING && t != LUA_TNUMBER) ||
+            (t == LUA_TNUMBER && lua_tonumber(L,-1) != lua_tonumber(L,-1)))
+            return luaL_error(L,"template keys must be strings or numbers");
+        lua_pushvalue(L,-1);
+        lua_rawget(L,-3);
+        if (!lua_isnil(L,-1))
+            return luaL_error(L,"duplicated key in template");
+        lua_pop(L,1);
+        lua_pushvalue(L,-1);
+        lua_pushboolean(L,1);
+        lua_rawset(L,-4);
+        lua_pushvalue(L,-1);
+        lua_rawseti(L,arg+2,j+1);
+        tpl->off[j] = tpl->keys.len;
+        mp_encode_lua_type(L,&tpl->keys,0);
+    }
+    tpl->off[n] = tpl->keys.len;
+    if (tpl->keys.err) return luaL_error(L,"Out of memory while compiling.");
+    lua_pop(L,1);
+    lua_pushcclosure(L,mp_template_pack,3);
+    return 1;
+}
+
+static int mp_template_gc(lua_State *L) {
+    mp_template *tpl = luaL_checkudata(L,1,LUACMSGPACK_TEMPLATE_MT);
+
+    mp_buf_free(&tpl->keys);
+    return 0;
+}
+
+/* --------------------------------- Decoding --------------------------------- */
+
+/* Tables are created with room for all the elements announced by the
+ * header, so that they are never rehashed while growing. The size hint can
+ * not be trusted, since it comes from the input, but every element takes
+ * at least one byte (two for a key/value pair), so it is capped to what the
+ * remaining input could possibly contain. */
+static void mp_decode_new_table(lua_State *L, mp_cur *c, size_t narr,
+                                size_t nrec)
+{
+    if (c->reuse) return; /* See mp_decode_into(). */
+    if (narr > c->left) narr = c->left;
+    if (nrec > c->left/2) nrec = c->left/2;
+    if (narr > INT_MAX) narr = INT_MAX;
+    if (nrec > INT_MAX) nrec = INT_MAX;
+    lua_createtable(L,(int)narr,(int)nrec);
+}
+
+/* Push an integer decoded from the input. Lua >= 5.3 gets an exact
+ * lua_Integer whenever it fits. */
+static void mp_push_int64(lua_State *L, int64_t n) {
+#if LUA_VERSION_NUM >= 503
+    if (n >= LUA_MININTEGER && n <= LUA_MAXINTEGER) {
+        lua_pushinteger(L,(lua_Integer)n);
+        return;
+    }
+#endif
+    lua_pushnumber(L,(lua_Number)n);
+}
+
+static void mp_push_uint64(lua_State *L, mp_cur *c, uint64_t n) {
+#if LUA_VERSION_NUM >= 503
+    if (n > (uint64_t)LUA_MAXINTEGER) {
+        switch(c->opts->uint64) {
+        case MP_UINT64_WRAP:
+            lua_pushinteger(L,(lua_Integer)n);
+            return;
+        case MP_UINT64_ERROR:
+            c->err = MP_CUR_ERROR_RANGE;
+            return;
+        }
+        lua_pushnumber(L,(lua_Number)n);
+        return;
+    }
+#else
+    (void) c; /* Options only matter with Lua >= 5.3 integers. */
+#endif
+    mp_push_int64(L,(int64_t)n);
+}
+
+/* What mp_decode_element() found. */
+#define MP_DEC_SCALAR   0   /* The value was pushed. */
+#define MP_DEC_ARRAY    1   /* An empty table was pushed, to fill with */
+#define MP_DEC_MAP      2   /* the elements or pairs that follow. */
+#define MP_DEC_REF      3   /* Nothing pushed, the table id is in '*count'. */
+
+static void mp_array_decode(lua_State *L, mp_cur *c, const unsigned char *p,
+                            size_t len);
+static void mp_ext_push(lua_State *L, int type, const unsigned char *p,
+                        size_t len);
+static int mp_ext_hook_decode(lua_State *L, mp_cur *c, int type,
+                              const unsigned char *p, size_t len);
+static void mp_slice_push(lua_State *L, const char *p, size_t len, int src);
+static const char *mp_tobytes(lua_State *L, int idx, size_t *len);
+static const char *mp_checkbytes(lua_State *L, int idx, size_t *len);
+
+/* Push the 'len' bytes of a str or bin at 'p', as a slice if the caller
+ * asked so and the string is long enough. */
+static void mp_push_bytes(lua_State *L, mp_cur *c, const unsigned char *p,
+                          size_t len)
+{
+    if (c->slice && len >= c->slice && c->src)
+        mp_slice_push(L,(const char*)p,len,c->src);
+    else
+        lua_pushlstring(L,(const char*)p,len);
+}
+
+/* Decode the payload of a timestamp, 'len' bytes at 'p', as the number of
+ * seconds since the epoch: an integer if there are no nanoseconds, or a
+ * float. */
+static void mp_timestamp_decode(lua_State *L, mp_cur *c,
+                                const unsigned char *p, size_t len)
+{
+    int64_t sec;
+    uint32_t nsec;
+    uint64_t v;
+
+    if (len == 4) {             /* timestamp 32 */
+        sec = mp_load32(p);
+        nsec = 0;
+    } else if (len == 8) {      /* timestamp 64 */
+        v = mp_load64(p);
+        sec = (int64_t)(v & 0x3ffffffffULL);
+        nsec = (uint32_t)(v >> 34);
+    } else if (len == 12) {     /* timestamp 96 */
+        nsec = mp_load32(p);
+        sec = (int64_t)mp_load64(p+4);
+    } else {
+        c->err = MP_CUR_ERROR_BADFMT;
+        return;
+    }
+    if (nsec > 999999999) {
+        c->err = MP_CUR_ERROR_BADFMT;
+        return;
+    }
+    if (nsec == 0)
+        mp_push_int64(L,sec);
+    else
+        lua_pushnumber(L,(lua_Number)sec+(lua_Number)nsec/1e9);
+}
+
+/* Decode the ext pointed by 'c', with a header of 'hdrlen' bytes (the type
+ * being the last one) and a payload of 'len' bytes. References to tables
+ * are only accepted in "dedupe" refs mode, typed arrays are decoded, then
+ * registered decoders are tried, see cmsgpack.register_ext(), then
+ * timestamps, and other types become ext values, see mp_ext_new(). */
+static void mp_decode_ext(lua_State *L, mp_cur *c, size_t hdrlen, size_t len,
+                          int *kind, size_t *count)
+{
+    const unsigned char *p;
+    int type;
+
+    mp_cur_need(c,hdrlen);
+    mp_cur_need(c,hdrlen+len);
+    p = c->p+hdrlen;
+    type = (signed char)c->p[hdrlen-1];
+    if (type == LUACMSGPACK_REF_EXT && c->opts->refs == MP_REFS_DEDUPE &&
+        len >= 1 && len <= 8)
+    {
+        uint64_t id = 0;
+        size_t j;
+
+        for (j = 0; j < len; j++) id = (id << 8) | p[j];
+        *kind = MP_DEC_REF;
+        *count = id > (size_t)-1 ? (size_t)-1 : (size_t)id;
+    } else if (type == LUACMSGPACK_ARRAY_EXT) {
+        mp_array_decode(L,c,p,len);
+        if (c->err) return;
+    } else if (mp_ext_hook_decode(L,c,type,p,len)) {
         if (c->err) return;
-        mp_decode_to_lua_type(L,c); /* value */
+    } else if (type == LUACMSGPACK_TIMESTAMP_EXT) {
+        mp_timestamp_decode(L,c,p,len);
         if (c->err) return;
-        lua_settable(L,-3);
+    } else if (type == LUACMSGPACK_REF_EXT) {
+        /* Can't be resolved, better to fail than to return another
+         * structure than the one encoded. */
+        c->err = MP_CUR_ERROR_BADFMT;
+        return;
+    } else {
+        mp_ext_push(L,type,p,len);
     }
+    mp_cur_consume(c,hdrlen+len);
 }
 
-/* Decode a Message Pack raw object pointed by the string cursor 'c' to
- * a Lua type, that is left as the only result on the stack. */
-void mp_decode_to_lua_type(lua_State *L, mp_cur *c) {
-    mp_cur_need(c,1);
-    switch(c->p[0]) {
+/* Decoding dispatches on the first byte of every element with two tables.
+ * mp_dec_family maps every byte to the first byte of its family, so that
+ * the fixnums, fixstr, fixarray and fixmap ranges take a single case of a
+ * dense switch, that compilers turn into a jump table. mp_dec_need is the
+ * size of the header plus the payload, when the header alone tells it (it
+ * is 1 for the other elements): one bounds check covers every element but
+ * the strings, bins and exts with a length field. */
+static const unsigned char mp_dec_family[256] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 00 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 08 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 10 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 18 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 20 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 28 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 30 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 38 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 40 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 48 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 50 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 58 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 60 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 68 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 70 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* 78 */
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,  /* 80 */
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,  /* 88 */
+    0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90,  /* 90 */
+    0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90,  /* 98 */
+    0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0,  /* a0 */
+    0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0,  /* a8 */
+    0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0,  /* b0 */
+    0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0,  /* b8 */
+    0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,  /* c0 */
+    0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf,  /* c8 */
+    0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7,  /* d0 */
+    0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,  /* d8 */
+    0xe0, 0xe0, 0xe0, 0xe0, 0xe0, 0xe0, 0xe0, 0xe0,  /* e0 */
+    0xe0, 0xe0, 0xe0, 0xe0, 0xe0, 0xe0, 0xe0, 0xe0,  /* e8 */
+    0xe0, 0xe0, 0xe0, 0xe0, 0xe0, 0xe0, 0xe0, 0xe0,  /* f0 */
+    0xe0, 0xe0, 0xe0, 0xe0, 0xe0, 0xe0, 0xe0, 0xe0   /* f8 */
+};
+
+static const unsigned char mp_dec_need[256] = {
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 00 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 10 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 20 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 30 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 40 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 50 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 60 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 70 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 80 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 90 */
+     1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,15,16,  /* a0 */
+    17,18,19,20,21,22,23,24,25,26,27,28,29,30,31,32,  /* b0 */
+     1, 1, 1, 1, 2, 3, 5, 3, 4, 6, 5, 9, 2, 3, 5, 9,  /* c0 */
+     2, 3, 5, 9, 2, 2, 2, 2, 2, 2, 3, 5, 3, 5, 3, 5,  /* d0 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* e0 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1   /* f0 */
+};
+
+/* Decode the Message Pack element pointed by the string cursor 'c': scalars
+ * are pushed on the stack, arrays and maps just push a table, setting
+ * '*count' to the number of elements, or pairs, that follow. References to
+ * tables, only accepted in "dedupe" refs mode, push nothing. */
+static void mp_decode_element(lua_State *L, mp_cur *c, int *kind,
+                              size_t *count)
+{
+    const unsigned char *p = c->p;
+    size_t l;
+
+    *kind = MP_DEC_SCALAR;
+    if (c->left == 0 || c->left < mp_dec_need[p[0]]) {
+        c->err = MP_CUR_ERROR_EOF;
+        return;
+    }
+    switch(mp_dec_family[p[0]]) {
+    case 0x00:  /* positive fixnum */
+        mp_push_int64(L,p[0]);
+        mp_cur_consume(c,1);
+        break;
+    case 0xe0:  /* negative fixnum */
+        mp_push_int64(L,(signed char)p[0]);
+        mp_cur_consume(c,1);
+        break;
+    case 0xa0:  /* fix str */
+        l = p[0] & 0x1f;
+        lua_pushlstring(L,(const char*)p+1,l);
+        mp_cur_consume(c,1+l);
+        break;
+    case 0x90:  /* fix array */
+        *kind = MP_DEC_ARRAY;
+        *count = p[0] & 0xf;
+        mp_cur_consume(c,1);
+        break;
+    case 0x80:  /* fix map */
+        *kind = MP_DEC_MAP;
+        *count = p[0] & 0xf;
+        mp_cur_consume(c,1);
+        break;
+    case 0xc0:  /* nil */
+        lua_pushnil(L);
+        mp_cur_consume(c,1);
+        break;
+    case 0xc2:  /* false */
+        lua_pushboolean(L,0);
+        mp_cur_consume(c,1);
+        break;
+    case 0xc3:  /* true */
+        lua_pushboolean(L,1);
+        mp_cur_consume(c,1);
+        break;
     case 0xcc:  /* uint 8 */
-        mp_cur_need(c,2);
-        lua_pushnumber(L,c->p[1]);
+        mp_push_int64(L,p[1]);
         mp_cur_consume(c,2);
         break;
     case 0xd0:  /* int 8 */
-        mp_cur_need(c,2);
-        lua_pushnumber(L,(char)c->p[1]);
+        mp_push_int64(L,(int8_t)p[1]);
         mp_cur_consume(c,2);
         break;
     case 0xcd:  /* uint 16 */
-        mp_cur_need(c,3);
-        lua_pushnumber(L,
-            (c->p[1] << 8) |
-             c->p[2]);
+        mp_push_int64(L,mp_load16(p+1));
         mp_cur_consume(c,3);
         break;
     case 0xd1:  /* int 16 */
-        mp_cur_need(c,3);
-        lua_pushnumber(L,(int16_t)
-            (c->p[1] << 8) |
-             c->p[2]);
+        mp_push_int64(L,(int16_t)mp_load16(p+1));
         mp_cur_consume(c,3);
         break;
     case 0xce:  /* uint 32 */
-        mp_cur_need(c,5);
-        lua_pushnumber(L,
-            ((uint32_t)c->p[1] << 24) |
-            ((uint32_t)c->p[2] << 16) |
-            ((uint32_t)c->p[3] << 8) |
-             (uint32_t)c->p[4]);
+        mp_push_int64(L,mp_load32(p+1));
         mp_cur_consume(c,5);
         break;
     case 0xd2:  /* int 32 */
-        mp_cur_need(c,5);
-        lua_pushnumber(L,
-            ((int32_t)c->p[1] << 24) |
-            ((int32_t)c->p[2] << 16) |
-            ((int32_t)c->p[3] << 8) |
-             (int32_t)c->p[4]);
+        mp_push_int64(L,(int32_t)mp_load32(p+1));
         mp_cur_consume(c,5);
         break;
     case 0xcf:  /* uint 64 */
-        mp_cur_need(c,9);
-        lua_pushnumber(L,
-            ((uint64_t)c->p[1] << 56) |
-            ((uint64_t)c->p[2] << 48) |
-            ((uint64_t)c->p[3] << 40) |
-            ((uint64_t)c->p[4] << 32) |
-            ((uint64_t)c->p[5] << 24) |
-            ((uint64_t)c->p[6] << 16) |
-            ((uint64_t)c->p[7] << 8) |
-             (uint64_t)c->p[8]);
+        mp_push_uint64(L,c,mp_load64(p+1));
+        if (c->err) return;
         mp_cur_consume(c,9);
         break;
     case 0xd3:  /* int 64 */
-        mp_cur_need(c,9);
-        lua_pushnumber(L,
-            ((int64_t)c->p[1] << 56) |
-            ((int64_t)c->p[2] << 48) |
-            ((int64_t)c->p[3] << 40) |
-            ((int64_t)c->p[4] << 32) |
-            ((int64_t)c->p[5] << 24) |
-            ((int64_t)c->p[6] << 16) |
-            ((int64_t)c->p[7] << 8) |
-             (int64_t)c->p[8]);
+        mp_push_int64(L,(int64_t)mp_load64(p+1));
         mp_cur_consume(c,9);
         break;
-    case 0xc0:  /* nil */
-        lua_pushnil(L);
-        mp_cur_consume(c,1);
-        break;
-    case 0xc3:  /* true */
-        lua_pushboolean(L,1);
-        mp_cur_consume(c,1);
-        break;
-    case 0xc2:  /* false */
-        lua_pushboolean(L,0);
-        mp_cur_consume(c,1);
-        break;
     case 0xca:  /* float */
-        mp_cur_need(c,5);
         assert(sizeof(float) == 4);
-        {
-            float f;
-            memcpy(&f,c->p+1,4);
-            memrevifle(&f,4);
-            lua_pushnumber(L,f);
-            mp_cur_consume(c,5);
-        }
+        lua_pushnumber(L,mp_load_float(p+1));
+        mp_cur_consume(c,5);
         break;
     case 0xcb:  /* double */
-        mp_cur_need(c,9);
         assert(sizeof(double) == 8);
-        {
-            double d;
-            memcpy(&d,c->p+1,8);
-            memrevifle(&d,8);
-            lua_pushnumber(L,d);
-            mp_cur_consume(c,9);
-        }
+        lua_pushnumber(L,mp_load_double(p+1));
+        mp_cur_consume(c,9);
         break;
-    case 0xda:  /* raw 16 */
-        mp_cur_need(c,3);
-        {
-            size_t l = (c->p[1] << 8) | c->p[2];
-            mp_cur_need(c,3+l);
-            lua_pushlstring(L,(char*)c->p+3,l);
-            mp_cur_consume(c,3+l);
-        }
+    case 0xd9:  /* str 8 */
+    case 0xc4:  /* bin 8 */
+        l = p[1];
+        mp_cur_need(c,2+l);
+        mp_push_bytes(L,c,p+2,l);
+        mp_cur_consume(c,2+l);
         break;
-    case 0xdb:  /* raw 32 */
-        mp_cur_need(c,5);
-        {
-            size_t l = (c->p[1] << 24) |
-                       (c->p[2] << 16) |
-                       (c->p[3] << 8) |
-                       c->p[4];
-            mp_cur_need(c,5+l);
-            lua_pushlstring(L,(char*)c->p+5,l);
-            mp_cur_consume(c,5+l);
-        }
+    case 0xda:  /* str 16 */
+    case 0xc5:  /* bin 16 */
+        l = mp_load16(p+1);
+        mp_cur_need(c,3+l);
+        mp_push_bytes(L,c,p+3,l);
+        mp_cur_consume(c,3+l);
+        break;
+    case 0xdb:  /* str 32 */
+    case 0xc6:  /* bin 32 */
+        l = mp_load32(p+1);
+        mp_cur_need(c,5+l);
+        mp_push_bytes(L,c,p+5,l);
+        mp_cur_consume(c,5+l);
         break;
     case 0xdc:  /* array 16 */
-        mp_cur_need(c,3);
-        {
-            size_t l = (c->p[1] << 8) | c->p[2];
-            mp_cur_consume(c,3);
-            mp_decode_to_lua_array(L,c,l);
-        }
+        *kind = MP_DEC_ARRAY;
+        *count = mp_load16(p+1);
+        mp_cur_consume(c,3);
         break;
     case 0xdd:  /* array 32 */
-        mp_cur_need(c,5);
-        {
-            size_t l = (c->p[1] << 24) |
-                       (c->p[2] << 16) |
-                       (c->p[3] << 8) |
-                       c->p[4];
-            mp_cur_consume(c,5);
-            mp_decode_to_lua_array(L,c,l);
-        }
+        *kind = MP_DEC_ARRAY;
+        *count = mp_load32(p+1);
+        mp_cur_consume(c,5);
         break;
     case 0xde:  /* map 16 */
-        mp_cur_need(c,3);
-        {
-            size_t l = (c->p[1] << 8) | c->p[2];
-            mp_cur_consume(c,3);
-            mp_decode_to_lua_hash(L,c,l);
-        }
+        *kind = MP_DEC_MAP;
+        *count = mp_load16(p+1);
+        mp_cur_consume(c,3);
         break;
     case 0xdf:  /* map 32 */
-        mp_cur_need(c,5);
-        {
-            size_t l = (c->p[1] << 24) |
-                       (c->p[2] << 16) |
-                       (c->p[3] << 8) |
-                       c->p[4];
-            mp_cur_consume(c,5);
-            mp_decode_to_lua_hash(L,c,l);
-        }
-        break;
-    default:    /* types that can't be idenitified by first byte value. */
-        if ((c->p[0] & 0x80) == 0) {   /* positive fixnum */
-            lua_pushnumber(L,c->p[0]);
-            mp_cur_consume(c,1);
-        } else if ((c->p[0] & 0xe0) == 0xe0) {  /* negative fixnum */
-            lua_pushnumber(L,(signed char)c->p[0]);
-            mp_cur_consume(c,1);
-        } else if ((c->p[0] & 0xe0) == 0xa0) {  /* fix raw */
-            size_t l = c->p[0] & 0x1f;
-            mp_cur_need(c,1+l);
-            lua_pushlstring(L,(char*)c->p+1,l);
-            mp_cur_consume(c,1+l);
-        } else if ((c->p[0] & 0xf0) == 0x90) {  /* fix map */
-            size_t l = c->p[0] & 0xf;
-            mp_cur_consume(c,1);
-            mp_decode_to_lua_array(L,c,l);
-        } else if ((c->p[0] & 0xf0) == 0x80) {  /* fix map */
-            size_t l = c->p[0] & 0xf;
-            mp_cur_consume(c,1);
-            mp_decode_to_lua_hash(L,c,l);
-        } else {
-            c->err = MP_CUR_ERROR_BADFMT;
+        *kind = MP_DEC_MAP;
+        *count = mp_load32(p+1);
+        mp_cur_consume(c,5);
+        break;
+    case 0xd4:  /* fix ext 1 */
+    case 0xd5:  /* fix ext 2 */
+    case 0xd6:  /* fix ext 4 */
+    case 0xd7:  /* fix ext 8 */
+    case 0xd8:  /* fix ext 16 */
+        mp_decode_ext(L,c,2,(size_t)1 << (p[0]-0xd4),kind,count);
+        break;
+    case 0xc7:  /* ext 8 */
+        mp_decode_ext(L,c,3,p[1],kind,count);
+        break;
+    case 0xc8:  /* ext 16 */
+        mp_decode_ext(L,c,4,mp_load16(p+1),kind,count);
+        break;
+    case 0xc9:  /* ext 32 */
+        mp_decode_ext(L,c,6,mp_load32(p+1),kind,count);
+        break;
+    default:    /* 0xc1, never used. */
+        c->err = MP_CUR_ERROR_BADFMT;
+    }
+    if (*kind == MP_DEC_ARRAY)
+        mp_decode_new_table(L,c,*count,0);
+    else if (*kind == MP_DEC_MAP)
+        mp_decode_new_table(L,c,0,*count);
+}
+
+/* Every table being filled has a frame, while the table itself is on the
+ * Lua stack, see mp_frames_grow(). */
+typedef struct mp_dec_frame {
+    size_t left;    /* Elements still to decode, keys and values for maps. */
+    size_t index;   /* Next array index. */
+    int map;
+} mp_dec_frame;
+
+/* Biggest element decoded by mp_decode_scalars(): a fix str of 31 bytes. */
+#define MP_SCALAR_MAXLEN 32
+
+/* Fast path for tables of scalars: decode the elements that follow straight
+ * into the table of the frame 'f', on top of the stack, in a tight loop.
+ * Stops at the end of the table, or at the first element that is not a
+ * number of a fixed size (uint 64 excluded, since it may need the options),
+ * a fixstr, a boolean or nil, or is truncated, that the generic decoder
+ * will handle. A map can be left with a key on the stack, and the value to
+ * decode next.
+ *
+ * Elements are decoded in runs that can't go past the end of the input
+ * even if all of them are of the biggest size, so the input length is
+ * checked once per run instead of once per element. Only the last few
+ * elements of the input are checked one by one. */
+static void mp_decode_scalars(lua_State *L, mp_cur *c, mp_dec_frame *f) {
+    const unsigned char *p = c->p, *end = c->p+c->left;
+    size_t n = f->left, index = f->index; /* Not reloaded after every call. */
+    size_t run, stop;
+    int map = f->map;
+
+    while(n) {
+        run = (size_t)(end-p)/MP_SCALAR_MAXLEN;
+        if (run == 0) {
+            if (p == end || mp_dec_need[p[0]] > (size_t)(end-p)) break;
+            run = 1;
+        }
+        stop = run < n ? n-run : 0;
+        while(n > stop) {
+            /* Arrays of positive fixnums or of fix strs, the most common,
+             * have loops of their own. */
+            if (!map && p[0] <= 0x7f) {
+                do {
+                    mp_push_int64(L,*p++);
+                    lua_rawseti(L,-2,index++);
+                    n--;
+                } while(n > stop && p[0] <= 0x7f);
+                continue;
+            }
+            if (!map && (p[0] & 0xe0) == 0xa0) {
+                do {
+                    lua_pushlstring(L,(const char*)p+1,p[0]&0x1f);
+                    p += 1+(p[0]&0x1f);
+                    lua_rawseti(L,-2,index++);
+                    n--;
+                } while(n > stop && (p[0] & 0xe0) == 0xa0);
+                continue;
+            }
+            switch(mp_dec_family[p[0]]) {
+            case 0x00: mp_push_int64(L,p[0]); break;
+            case 0xe0: mp_push_int64(L,(int8_t)p[0]); break;
+            case 0xa0: lua_pushlstring(L,(const char*)p+1,p[0]&0x1f); break;
+            case 0xc0: lua_pushnil(L); break;
+            case 0xc2: lua_pushboolean(L,0); break;
+            case 0xc3: lua_pushboolean(L,1); break;
+            case 0xca: lua_pushnumber(L,mp_load_float(p+1)); break;
+            case 0xcb: lua_pushnumber(L,mp_load_double(p+1)); break;
+            case 0xcc: mp_push_int64(L,p[1]); break;
+            case 0xd0: mp_push_int64(L,(int8_t)p[1]); break;
+            case 0xcd: mp_push_int64(L,mp_load16(p+1)); break;
+            case 0xd1: mp_push_int64(L,(int16_t)mp_load16(p+1)); break;
+            case 0xce: mp_push_int64(L,mp_load32(p+1)); break;
+            case 0xd2: mp_push_int64(L,(int32_t)mp_load32(p+1)); break;
+            case 0xd3: mp_push_int64(L,(int64_t)mp_load64(p+1)); break;
+            default: goto done;
+            }
+            p += mp_dec_need[p[0]];
+            n--;
+            if (!map)
+                lua_rawseti(L,-2,index++);
+            else if (!(n & 1))
+                lua_rawset(L,-3);
         }
     }
+done:
+    f->left = n;
+    f->index = index;
+    c->left -= p-c->p;
+    c->p = p;
 }
 
-static int mp_unpack(lua_State *L) {
-    size_t len;
-    const unsigned char *s;
-    mp_cur *c;
+/* Decode a Message Pack raw object pointed by the string cursor 'c' to
+ * a Lua type, that is left as the only result on the stack (nil if an
+ * error is set in the cursor). Tables nested more than c->opts->max_depth
+ * levels are reported as MP_CUR_ERROR_DEPTH.
+ *
+ * In "dedupe" refs mode all the tables created are also stored, in order,
+ * into a table at 'base' (created with the first one), to resolve the
+ * references to them. Frames are then anchored just above it. */
+void mp_decode_to_lua_type(lua_State *L, mp_cur *c) {
+    mp_dec_frame inline_frames[LUACMSGPACK_INLINE_FRAMES];
+    mp_dec_frame *frames = inline_frames, *f;
+    int base = lua_gettop(L)+1, cap = LUACMSGPACK_INLINE_FRAMES, top = 0;
+    int room = 0, kind, anchor = base;
+    size_t count, nrefs = 0;
 
-    if (!lua_isstring(L,-1)) {
-        lua_pushstring(L,"MessagePack decoding needs a string as input.");
-        lua_error(L);
+    for (;;) {
+        /* Every frame takes a stack slot, check them in bulk. */
+        if (lua_gettop(L)+8 > room &&
+            (room = mp_stack_room(L,16+top,8)) == 0)
+        {
+            c->err = MP_CUR_ERROR_DEPTH;
+            break;
+        }
+        mp_decode_element(L,c,&kind,&count);
+        if (c->err) break;
+        if (kind == MP_DEC_REF) {
+            if (count >= nrefs) {
+                c->err = MP_CUR_ERROR_BADFMT;
+                break;
+            }
+            lua_rawgeti(L,base,(int)count+1);
+        } else if (kind != MP_DEC_SCALAR) {
+            if (c->opts->refs == MP_REFS_DEDUPE) {
+                if (nrefs == 0) {
+                    lua_newtable(L);
+                    lua_insert(L,base);
+                    anchor = base+1;
+                }
+                lua_pushvalue(L,-1);
+                lua_rawseti(L,base,(int)++nrefs);
+            }
+            if (top >= c->opts->max_depth) {
+                c->err = MP_CUR_ERROR_DEPTH;
+                break;
+            }
+            mp_stats_depth(c->stats,top+1);
+            if (count) {
+                if (top == cap) {
+                    frames = mp_frames_grow(L,frames,sizeof(*frames),&cap,
+                                            anchor,frames == inline_frames);
+                }
+                f = &frames[top++];
+                f->map = kind == MP_DEC_MAP;
+                f->left = f->map ? count*2 : count;
+                f->index = 1;
+                mp_decode_scalars(L,c,f);
+                if (f->left) continue;
+                top--; /* Only scalars, the table is complete. */
+            }
+        }
+
+        /* A value is complete, store it into the enclosing tables that
+         * are complete as well. */
+        while(top) {
+            f = &frames[top-1];
+            f->left--;
+            if (!f->map)
+                lua_rawseti(L,-2,f->index++);
+            else if (!(f->left & 1))
+                lua_rawset(L,-3);
+            /* Else that was a key, the value follows. */
+            mp_decode_scalars(L,c,f);
+            if (f->left) break;
+            top--;
+        }
+        if (top == 0) break;
+    }
+    if (c->err) {
+        lua_settop(L,base-1);
+        lua_pushnil(L);
+        return;
     }
+    if (frames != inline_frames) lua_remove(L,anchor);
+    if (nrefs) lua_remove(L,base);
+}
 
-    s = (const unsigned char*) lua_tolstring(L,-1,&len);
-    c = mp_cur_new(s,len);
-    mp_decode_to_lua_type(L,c);
-    
+/* Raise a Lua error if the cursor is in an error state. */
+static void mp_cur_check(lua_State *L, mp_cur *c) {
     if (c->err == MP_CUR_ERROR_EOF) {
-        mp_cur_free(c);
         lua_pushstring(L,"Missing bytes in input.");
         lua_error(L);
     } else if (c->err == MP_CUR_ERROR_BADFMT) {
-        mp_cur_free(c);
         lua_pushstring(L,"Bad data format in input.");
         lua_error(L);
-    } else if (c->left != 0) {
-        mp_cur_free(c);
+    } else if (c->err == MP_CUR_ERROR_RANGE) {
+        lua_pushstring(L,"Integer out of range in input.");
+        lua_error(L);
+    } else if (c->err == MP_CUR_ERROR_DEPTH) {
+        lua_pushstring(L,"Nesting too deep in input.");
+        lua_error(L);
+    }
+}
+
+/* Min length of the strings decoded as slices, from the optional argument
+ * at 'idx'. */
+static size_t mp_slice_arg(lua_State *L, int idx) {
+    lua_Integer n = luaL_optinteger(L,idx,0);
+
+    luaL_argcheck(L,n >= 0,idx,"slice threshold must be >= 0");
+    return (size_t)n;
+}
+
+/* cmsgpack.unpack(s [, slice]) -- Decode the only object in 's', that can
+ * be a string or a slice. Strings of at least 'slice' bytes are returned
+ * as slices of 's'. */
+static int mp_unpack(lua_State *L) {
+    mp_codec *codec = mp_codec_get(L);
+    int arg = mp_codec_firstarg(L);
+    size_t len;
+    const unsigned char *s;
+    mp_cur c;
+#ifdef LUACMSGPACK_STATS
+    double t0 = LUACMSGPACK_STATS_CLOCK();
+#endif
+
+    s = (const unsigned char*) mp_tobytes(L,arg,&len);
+    if (s == NULL) {
+        lua_pushstring(L,"MessagePack decoding needs a string as input.");
+        lua_error(L);
+    }
+    mp_cur_init(&c,s,len);
+    c.opts = &codec->opts;
+    c.src = arg;
+    c.slice = mp_slice_arg(L,arg+1);
+#ifdef LUACMSGPACK_STATS
+    c.stats = &codec->stats;
+#endif
+    mp_decode_to_lua_type(L,&c);
+    mp_cur_check(L,&c);
+    if (c.left != 0) {
         lua_pushstring(L,"Extra bytes in input.");
         lua_error(L);
-    } else {
-        mp_cur_free(c);
     }
+#ifdef LUACMSGPACK_STATS
+    mp_stats_unpack(c.stats,len,t0);
+#endif
     return 1;
 }
 
-/* ---------------------------------------------------------------------------- */
+/* Decode up to 'limit' objects (all of them if 'limit' is 0) from the
+ * string argument at 'arg', starting at the position given by the optional
+ * argument that follows it, with the slice threshold after it. Positions
+ * are 1-based like in string.unpack(), and the position of the first byte
+ * not consumed is returned after the objects. */
+static int mp_unpack_limit_common(lua_State *L, int arg, lua_Integer limit) {
+    mp_codec *codec = mp_codec_get(L);
+    size_t len;
+    const unsigned char *s;
+    lua_Integer offset;
+    int count = 0;
+    mp_cur c;
+#ifdef LUACMSGPACK_STATS
+    double t0 = LUACMSGPACK_STATS_CLOCK();
+#endif
 
-#if LUA_VERSION_NUM < 502
-static const struct luaL_reg thislib[] = {
-#else
-static const struct luaL_Reg thislib[] = {
+    s = (const unsigned char*) mp_checkbytes(L,arg,&len);
+    offset = luaL_optinteger(L,arg+1,1);
+    luaL_argcheck(L,offset >= 1 && (size_t)offset <= len+1,arg+1,
+        "offset out of string");
+
+    mp_cur_init(&c,s+offset-1,len-(offset-1));
+    c.opts = &codec->opts;
+    c.src = arg;
+    c.slice = mp_slice_arg(L,arg+2);
+#ifdef LUACMSGPACK_STATS
+    c.stats = &codec->stats;
 #endif
-    {"pack", mp_pack},
-    {"unpack", mp_unpack},
-    {NULL, NULL}
-};
+    while(c.left && (limit == 0 || count < limit)) {
+        luaL_checkstack(L,2,"too many objects to unpack");
+        mp_decode_to_lua_type(L,&c);
+        mp_cur_check(L,&c);
+        count++;
+    }
+#ifdef LUACMSGPACK_STATS
+    mp_stats_unpack(c.stats,len-c.left-(offset-1),t0);
+#endif
+    lua_pushinteger(L,(lua_Integer)(len-c.left+1));
+    return count+1;
+}
 
-LUALIB_API int luaopen_cmsgpack_core (lua_State *L) {
-#if LUA_VERSION_NUM < 502
-    luaL_register(L, "cmsgpack", thislib);
-#else
-    luaL_newlib(L, thislib);
+/* cmsgpack.unpack_one(s [, offset [, slice]]) -- Decode the object at
+ * 'offset', returning it and the position of the next object. */
+static int mp_unpack_one(lua_State *L) {
+    int arg = mp_codec_firstarg(L);
+    size_t len;
+
+    mp_checkbytes(L,arg,&len);
+    if ((size_t)luaL_optinteger(L,arg+1,1) == len+1) {
+        lua_pushstring(L,"Missing bytes in input.");
+        lua_error(L);
+    }
+    return mp_unpack_limit_common(L,arg,1);
+}
+
+/* cmsgpack.unpack_limit(s, n [, offset [, slice]]) -- Decode up to 'n'
+ * objects starting at 'offset', returning them and the position of the
+ * next one. */
+static int mp_unpack_limit(lua_State *L) {
+    int arg = mp_codec_firstarg(L);
+    lua_Integer limit = luaL_checkinteger(L,arg+1);
+
+    luaL_argcheck(L,limit >= 0,arg+1,"limit must be >= 0");
+    lua_remove(L,arg+1);
+    return mp_unpack_limit_common(L,arg,limit);
+}
+
+/* ------------------------- Decoding into existing tables ----------------------
+ * cmsgpack.unpack_into(target, s [, prune]) decodes 's' like unpack() but
+ * fills the tables already in 'target' instead of creating new ones: the
+ * top level array or map is decoded into 'target' itself, and every nested
+ * array or map into the table found at the same index or key, if any. So
+ * decoding again and again messages of the same shape allocates nothing.
+ *
+ * Elements past the end of a decoded array are cleared. With 'prune' every
+ * other key that was not in the message is removed too, so that the result
+ * is the same as unpack(), but this takes a pass over the tables. */
+
+static int mp_skip_object(const unsigned char *p, size_t left, size_t *len);
+
+typedef struct mp_into_frame {
+    mp_dec_frame d;             /* For mp_decode_scalars(). */
+    size_t count;               /* Elements, or pairs, of the message. */
+    const unsigned char *start; /* First element. */
+    int reused;                 /* The table was already there. */
+} mp_into_frame;
+
+/* Is 'b' the first byte of an array or a map? */
+static int mp_is_container(unsigned char b) {
+    return (b & 0xe0) == 0x80 || (b >= 0xdc && b <= 0xdf);
+}
+
+/* The reused table on top of the stack was filled with the elements of the
+ * frame 'f': remove what is left of the previous content. */
+static void mp_into_done(lua_State *L, mp_cur *c, mp_into_frame *f,
+                         int prune)
+{
+    size_t j, n, len;
+    lua_Number k;
+    int kind;
+    mp_cur kcur, *kc = &kcur;
+
+    if (!f->reused) return;
+    if (!f->d.map && !prune) {
+        /* Just the tail, up to the first hole. */
+        for (j = f->count+1; ; j++) {
+            lua_rawgeti(L,-1,j);
+            if (lua_isnil(L,-1)) break;
+            lua_pop(L,1);
+            lua_pushnil(L);
+            lua_rawseti(L,-2,j);
+        }
+        lua_pop(L,1);
+        return;
+    }
+    if (!prune) return;
+    if (f->d.map) {
+        /* Collect the keys of the message, walking it again. Counting the
+         * keys of the table is not enough to skip this: keys with a nil
+         * value and repeated keys make the message count differ from the
+         * keys actually stored. */
+        lua_createtable(L,0,f->count > INT_MAX ? INT_MAX : (int)f->count);
+        mp_cur_init(kc,f->start,c->p-f->start);
+        kc->opts = c->opts;
+        for (j = 0; j < f->count; j++) {
+            if (mp_is_container(kc->p[0])) {
+                if (mp_skip_object(kc->p,kc->left,&len)) break;
+                mp_cur_consume(kc,len);
+            } else {
+                mp_decode_element(L,kc,&kind,&len);
+                if (kc->err) break;
+                lua_pushboolean(L,1);
+                lua_rawset(L,-3);
+            }
+            if (mp_skip_object(kc->p,kc->left,&len)) break;
+            mp_cur_consume(kc,len);
+        }
+    }
+
+    /* Stack: ... table [keys] */
+    lua_pushnil(L);
+    while(lua_next(L,f->d.map ? -3 : -2)) {
+        lua_pop(L,1);
+        if (f->d.map) {
+            lua_pushvalue(L,-1);
+            lua_rawget(L,-3);
+            n = !lua_isnil(L,-1);
+            lua_pop(L,1);
+        } else {
+            k = lua_type(L,-1) == LUA_TNUMBER ? lua_tonumber(L,-1) : 0;
+            n = k >= 1 && k <= (lua_Number)f->count && floor(k) == k;
+        }
+        if (!n) {
+            lua_pushvalue(L,-1);
+            lua_pushnil(L);
+            lua_rawset(L,f->d.map ? -5 : -4);
+        }
+    }
+    if (f->d.map) lua_pop(L,1);
+}
+
+/* Decode the object pointed by 'c' into the table on top of the stack,
+ * that is replaced by the result, like mp_decode_to_lua_type() does. */
+static void mp_decode_into(lua_State *L, mp_cur *c, int prune) {
+    mp_into_frame inline_frames[LUACMSGPACK_INLINE_FRAMES];
+    mp_into_frame *frames = inline_frames, *f;
+    int anchor = lua_gettop(L), cap = LUACMSGPACK_INLINE_FRAMES, top = 0;
+    int room = 0, kind, reuse;
+    size_t count;
+
+    for (;;) {
+        if (lua_gettop(L)+8 > room &&
+            (room = mp_stack_room(L,16+top,8)) == 0)
+        {
+            c->err = MP_CUR_ERROR_DEPTH;
+            break;
+        }
+        /* Push the value the element replaces, the target at first. */
+        if (top == 0) {
+            lua_pushvalue(L,-1);
+        } else {
+            f = &frames[top-1];
+            if (!f->reused || (f->d.map && !(f->d.left & 1))) {
+                lua_pushnil(L); /* New table or map key. */
+            } else if (!f->d.map) {
+                lua_rawgeti(L,-1,f->d.index);
+            } else {
+                lua_pushvalue(L,-1);
+                lua_rawget(L,-3);
+            }
+        }
+        /* An array or a map fills the table already there. */
+        reuse = c->left && mp_is_container(c->p[0]) &&
+                lua_type(L,-1) == LUA_TTABLE;
+        if (!reuse) lua_pop(L,1);
+        c->reuse = reuse;
+        mp_decode_element(L,c,&kind,&count);
+        c->reuse = 0;
+        if (c->err) break;
+        if (kind == MP_DEC_ARRAY || kind == MP_DEC_MAP) {
+            if (top >= c->opts->max_depth) {
+                c->err = MP_CUR_ERROR_DEPTH;
+                break;
+            }
+            mp_stats_depth(c->stats,top+1);
+            if (count || reuse) {
+                if (top == cap) {
+                    frames = mp_frames_grow(L,frames,sizeof(*frames),&cap,
+                                            anchor,frames == inline_frames);
+                }
+                f = &frames[top++];
+                f->d.map = kind == MP_DEC_MAP;
+                f->d.left = f->d.map ? count*2 : count;
+                f->d.index = 1;
+                f->count = count;
+                f->start = c->p;
+                f->reused = reuse;
+                mp_decode_scalars(L,c,&f->d);
+                if (f->d.left) continue;
+                mp_into_done(L,c,f,prune);
+                top--;
+            }
+        }
+
+        /* A value is complete, store it into the enclosing tables that
+         * are complete as well. */
+        while(top) {
+            f = &frames[top-1];
+            f->d.left--;
+            if (!f->d.map)
+                lua_rawseti(L,-2,f->d.index++);
+            else if (!(f->d.left & 1))
+                lua_rawset(L,-3);
+            mp_decode_scalars(L,c,&f->d);
+            if (f->d.left) break;
+            mp_into_done(L,c,f,prune);
+            top--;
+        }
+        if (top == 0) break;
+    }
+    if (c->err) {
+        lua_settop(L,anchor-1);
+        lua_pushnil(L);
+        return;
+    }
+    if (frames != inline_frames) lua_remove(L,anchor);
+    lua_remove(L,-2); /* The target. */
+}
+
+/* cmsgpack.unpack_into(target, s [, prune]) -- Decode 's' into the table
+ * 'target' and return the result: 'target' itself, unless 's' is not an
+ * array or a map. The 'refs' codec option is not supported. */
+static int mp_unpack_into(lua_State *L) {
+    mp_codec *codec = mp_codec_get(L);
+    int arg = mp_codec_firstarg(L);
+    int prune = lua_toboolean(L,arg+2);
+    size_t len;
+    const unsigned char *s;
+    mp_opts opts = codec->opts;
+    mp_cur c;
+#ifdef LUACMSGPACK_STATS
+    double t0 = LUACMSGPACK_STATS_CLOCK();
+#endif
+
+    luaL_checktype(L,arg,LUA_TTABLE);
+    s = (const unsigned char*) mp_checkbytes(L,arg+1,&len);
+    opts.refs = MP_REFS_OFF;
+    mp_cur_init(&c,s,len);
+    c.opts = &opts;
+    c.src = arg+1;
+    lua_settop(L,arg+1);
+    lua_pushvalue(L,arg);
+#ifdef LUACMSGPACK_STATS
+    c.stats = &codec->stats;
+#endif
+    mp_decode_into(L,&c,prune);
+    mp_cur_check(L,&c);
+    if (c.left != 0) {
+        lua_pushstring(L,"Extra bytes in input.");
+        lua_error(L);
+    }
+#ifdef LUACMSGPACK_STATS
+    mp_stats_unpack(c.stats,len,t0);
+#endif
+    return 1;
+}
+
+/* ------------------------------ Element scanning -----------------------------
+ * Sometimes we need to know where an object ends without decoding it. Since
+ * MessagePack is a prefix encoding this only requires to look at headers:
+ * every element is a header, an optional payload whose length is known from
+ * the header, and for arrays and maps a number of nested elements that
+ * follow. So walking an object just requires a counter of the elements
+ * still to visit, and no recursion. */
+
+/* Examine the element starting at 'p', with 'left' bytes available. On
+ * success MP_CUR_ERROR_NONE is returned, '*len' is set to the size of the
+ * header plus the payload, and '*count' to the number of nested elements
+ * that follow. MP_CUR_ERROR_EOF is returned if 'left' is too small to know
+ * or to contain the element, MP_CUR_ERROR_BADFMT if it is not valid. */
+static int mp_scan_element(const unsigned char *p, size_t left, size_t *len,
+                           uint64_t *count)
+{
+    size_t hdr = 1, payload = 0;
+
+    if (left < 1) return MP_CUR_ERROR_EOF;
+    *count = 0;
+    switch(p[0]) {
+    case 0xc0: case 0xc2: case 0xc3: break;         /* nil, false, true */
+    case 0xcc: case 0xd0: payload = 1; break;       /* uint/int 8 */
+    case 0xcd: case 0xd1: payload = 2; break;       /* uint/int 16 */
+    case 0xce: case 0xd2: case 0xca: payload = 4; break; /* 32 bits, float */
+    case 0xcf: case 0xd3: case 0xcb: payload = 8; break; /* 64 bits, double */
+    case 0xd9: case 0xc4:   /* str 8, bin 8 */
+        if (left < 2) return MP_CUR_ERROR_EOF;
+        hdr = 2;
+        payload = p[1];
+        break;
+    case 0xda: case 0xc5:   /* str 16, bin 16 */
+        if (left < 3) return MP_CUR_ERROR_EOF;
+        hdr = 3;
+        payload = (p[1] << 8) | p[2];
+        break;
+    case 0xdb: case 0xc6:   /* str 32, bin 32 */
+        if (left < 5) return MP_CUR_ERROR_EOF;
+        hdr = 5;
+        payload = ((size_t)p[1] << 24) | (p[2] << 16) | (p[3] << 8) | p[4];
+        break;
+    case 0xdc: case 0xde:   /* array 16, map 16 */
+        if (left < 3) return MP_CUR_ERROR_EOF;
+        hdr = 3;
+        *count = (p[1] << 8) | p[2];
+        if (p[0] == 0xde) *count *= 2;
+        break;
+    case 0xdd: case 0xdf:   /* array 32, map 32 */
+        if (left < 5) return MP_CUR_ERROR_EOF;
+        hdr = 5;
+        *count = ((uint64_t)p[1] << 24) | (p[2] << 16) | (p[3] << 8) | p[4];
+        if (p[0] == 0xdf) *count *= 2;
+        break;
+    case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8: /* fix ext */
+        if (left < 2) return MP_CUR_ERROR_EOF;
+        hdr = 2;
+        payload = (size_t)1 << (p[0]-0xd4);
+        break;
+    case 0xc7:  /* ext 8 */
+        if (left < 3) return MP_CUR_ERROR_EOF;
+        hdr = 3;
+        payload = p[1];
+        break;
+    case 0xc8:  /* ext 16 */
+        if (left < 4) return MP_CUR_ERROR_EOF;
+        hdr = 4;
+        payload = mp_load16(p+1);
+        break;
+    case 0xc9:  /* ext 32 */
+        if (left < 6) return MP_CUR_ERROR_EOF;
+        hdr = 6;
+        payload = mp_load32(p+1);
+        break;
+    default:
+        if ((p[0] & 0x80) == 0 || (p[0] & 0xe0) == 0xe0) {
+            /* positive or negative fixnum */
+        } else if ((p[0] & 0xe0) == 0xa0) {     /* fix str */
+            payload = p[0] & 0x1f;
+        } else if ((p[0] & 0xf0) == 0x90) {     /* fix array */
+            *count = p[0] & 0xf;
+        } else if ((p[0] & 0xf0) == 0x80) {     /* fix map */
+            *count = (p[0] & 0xf)*2;
+        } else {
+            return MP_CUR_ERROR_BADFMT;
+        }
+    }
+    if (left-hdr < payload) return MP_CUR_ERROR_EOF;
+    *len = hdr+payload;
+    return MP_CUR_ERROR_NONE;
+}
+
+/* Return the header size of a str or bin element starting with the byte
+ * 'b', or 0 if it is of another type. */
+static size_t mp_str_header(unsigned char b) {
+    switch(b) {
+    case 0xd9: case 0xc4: return 2;
+    case 0xda: case 0xc5: return 3;
+    case 0xdb: case 0xc6: return 5;
+    default: return (b & 0xe0) == 0xa0;
+    }
+}
+
+/* Set '*len' to the size of the whole object starting at 'p', nested
+ * elements included, or to 0 on errors, that are reported like in
+ * mp_scan_element(). */
+static int mp_skip_object(const unsigned char *p, size_t left, size_t *len) {
+    uint64_t pending = 1, count;
+    size_t off = 0, elen;
+    int err;
+
+    *len = 0;
+    while(pending) {
+        err = mp_scan_element(p+off,left-off,&elen,&count);
+        if (err != MP_CUR_ERROR_NONE) return err;
+        off += elen;
+        pending += count-1;
+    }
+    *len = off;
+    return MP_CUR_ERROR_NONE;
+}
+
+/* Statistics collected by mp_scan(). */
+typedef struct mp_scan_stats {
+    uint64_t objects;       /* Top level objects. */
+    uint64_t elements;      /* Elements at any level, containers included. */
+    uint64_t arrays;
+    uint64_t maps;
+    uint64_t string_bytes;  /* Bytes of string payloads. */
+    int depth;              /* Max nesting of arrays and maps. */
+    size_t pos;             /* Offset of the element causing an error. */
+} mp_scan_stats;
+
+/* Walk all the objects in 'p', collecting statistics into 'st' without
+ * allocating memory: the elements still to visit at every nesting level
+ * are kept in an array on the C stack, so nesting deeper than
+ * LUACMSGPACK_SCAN_DEPTH levels is reported as MP_CUR_ERROR_DEPTH. On
+ * errors 'st->pos' is set to the offset of the offending element. */
+static int mp_scan(const unsigned char *p, size_t len, mp_scan_stats *st) {
+    uint64_t left[LUACMSGPACK_SCAN_DEPTH], count;
+    size_t off = 0, elen;
+    int level = 0, container, err;
+
+    memset(st,0,sizeof(*st));
+    while(off < len) {
+        st->objects++;
+        do {
+            st->pos = off;
+            err = mp_scan_element(p+off,len-off,&elen,&count);
+            if (err != MP_CUR_ERROR_NONE) return err;
+            st->elements++;
+            if (level) left[level-1]--;
+            container = 0;
+            if (mp_str_header(p[off])) {
+                st->string_bytes += elen-mp_str_header(p[off]);
+            } else if ((p[off] & 0xf0) == 0x90 || p[off] == 0xdc ||
+                       p[off] == 0xdd) {
+                st->arrays++;
+                container = 1;
+            } else if ((p[off] & 0xf0) == 0x80 || p[off] == 0xde ||
+                       p[off] == 0xdf) {
+                st->maps++;
+                container = 1;
+            }
+            off += elen;
+            if (container) {
+                if (level == LUACMSGPACK_SCAN_DEPTH) return MP_CUR_ERROR_DEPTH;
+                if (level+1 > st->depth) st->depth = level+1;
+                if (count) left[level++] = count;
+            }
+            while(level && left[level-1] == 0) level--;
+        } while(level);
+    }
+    return MP_CUR_ERROR_NONE;
+}
+
+static const char *mp_scan_errstr(int err) {
+    switch(err) {
+    case MP_CUR_ERROR_EOF: return "Missing bytes in input.";
+    case MP_CUR_ERROR_BADFMT: return "Bad data format in input.";
+    case MP_CUR_ERROR_DEPTH: return "Nesting too deep in input.";
+    default: return NULL;
+    }
+}
+
+/* Raise the error returned by mp_scan_element(), mp_skip_object() or
+ * mp_scan(). */
+static void mp_scan_check(lua_State *L, int err) {
+    if (err != MP_CUR_ERROR_NONE) {
+        lua_pushstring(L,mp_scan_errstr(err));
+        lua_error(L);
+    }
+}
+
+/* ------------------------------ Codec statistics ------------------------------
+ * Counters of pack(), unpack(), unpack_one(), unpack_limit() and
+ * unpack_into(), collected only when LUACMSGPACK_STATS is defined, see the
+ * top of this file. Packers, jobs, views and the other APIs are not
+ * counted, but for the elements that other APIs encode with the codec
+ * buffer. */
+
+#ifdef LUACMSGPACK_STATS
+/* Account for the encoding in 'buf', started at 't0'. The elements were
+ * already counted by the encoder. */
+static void mp_stats_pack(mp_stats *st, const mp_buf *buf, double t0) {
+    if (st == NULL) return;
+    st->pack_time += LUACMSGPACK_STATS_CLOCK()-t0;
+    st->pack_calls++;
+    st->bytes_out += buf->len;
+}
+
+/* Count the elements of the valid MessagePack in 'p' by type if 'add' is
+ * true, otherwise uncount them. Every element is just visited one after
+ * the other. */
+static void mp_stats_elements(mp_buf *buf, const unsigned char *p,
+                              size_t len, int add)
+{
+    size_t off = 0, elen;
+    uint64_t count;
+
+    if (buf->stats == NULL) return;
+    while(off < len && mp_scan_element(p+off,len-off,&elen,&count) ==
+                       MP_CUR_ERROR_NONE)
+    {
+        if (add)
+            buf->stats->types[p[off]]++;
+        else
+            buf->stats->types[p[off]]--;
+        off += elen;
+    }
+}
+
+/* Account for the decoding of 'len' bytes, started at 't0'. */
+static void mp_stats_unpack(mp_stats *st, size_t len, double t0) {
+    if (st == NULL) return;
+    st->unpack_time += LUACMSGPACK_STATS_CLOCK()-t0;
+    st->unpack_calls++;
+    st->bytes_in += len;
+}
+
+/* Name of the type family starting with the byte 'b', NULL if none. */
+static const char *mp_stats_type_name(int b) {
+    switch(b) {
+    case 0x00: return "fixint";
+    case 0x80: return "fixmap";
+    case 0x90: return "fixarray";
+    case 0xa0: return "fixstr";
+    case 0xc0: return "nil";
+    case 0xc2: return "false";
+    case 0xc3: return "true";
+    case 0xc4: return "bin8";
+    case 0xc5: return "bin16";
+    case 0xc6: return "bin32";
+    case 0xc7: return "ext8";
+    case 0xc8: return "ext16";
+    case 0xc9: return "ext32";
+    case 0xca: return "float32";
+    case 0xcb: return "float64";
+    case 0xcc: return "uint8";
+    case 0xcd: return "uint16";
+    case 0xce: return "uint32";
+    case 0xcf: return "uint64";
+    case 0xd0: return "int8";
+    case 0xd1: return "int16";
+    case 0xd2: return "int32";
+    case 0xd3: return "int64";
+    case 0xd4: return "fixext1";
+    case 0xd5: return "fixext2";
+    case 0xd6: return "fixext4";
+    case 0xd7: return "fixext8";
+    case 0xd8: return "fixext16";
+    case 0xd9: return "str8";
+    case 0xda: return "str16";
+    case 0xdb: return "str32";
+    case 0xdc: return "array16";
+    case 0xdd: return "array32";
+    case 0xde: return "map16";
+    case 0xdf: return "map32";
+    case 0xe0: return "negfixint";
+    default: return NULL;
+    }
+}
+
+static void mp_stats_setfield(lua_State *L, const char *name, uint64_t v) {
+    lua_pushinteger(L,(lua_Integer)v);
+    lua_setfield(L,-2,name);
+}
+
+/* cmsgpack.stats() -- Return a table with the counters of the codec. The
+ * 'types' field maps the names of the types encoded (such as "fixint",
+ * "str16" or "map32") to the number of elements of that type. */
+static int mp_stats_lua(lua_State *L) {
+    mp_stats *st = &mp_codec_get(L)->stats;
+    uint64_t types[256];
+    const char *name;
+    int j;
+
+    lua_newtable(L);
+    mp_stats_setfield(L,"pack_calls",st->pack_calls);
+    mp_stats_setfield(L,"unpack_calls",st->unpack_calls);
+    mp_stats_setfield(L,"bytes_out",st->bytes_out);
+    mp_stats_setfield(L,"bytes_in",st->bytes_in);
+    mp_stats_setfield(L,"buffer_reallocs",st->reallocs);
+    mp_stats_setfield(L,"buffer_peak",st->peak_buffer);
+    mp_stats_setfield(L,"max_depth",st->max_depth);
+    lua_pushnumber(L,st->pack_time);
+    lua_setfield(L,-2,"pack_time");
+    lua_pushnumber(L,st->unpack_time);
+    lua_setfield(L,-2,"unpack_time");
+    /* Counters are by first byte, add up the ones of every family. */
+    for (j = 0; j < 256; j++) types[j] = 0;
+    for (j = 0; j < 256; j++) types[mp_dec_family[j]] += st->types[j];
+    lua_newtable(L);
+    for (j = 0; j < 256; j++) {
+        if (types[j] && (name = mp_stats_type_name(j)) != NULL)
+            mp_stats_setfield(L,name,types[j]);
+    }
+    lua_setfield(L,-2,"types");
+    return 1;
+}
+
+/* cmsgpack.reset_stats() -- Zero all the counters of the codec. */
+static int mp_reset_stats(lua_State *L) {
+    mp_stats *st = &mp_codec_get(L)->stats;
+
+    memset(st,0,sizeof(*st));
+    return 0;
+}
+#endif
+
+/* ----------------------------- Streaming unpacker ----------------------------
+ * cmsgpack.unpacker() returns an object that is fed with chunks of input of
+ * any size as they arrive, and returns the complete top level objects as
+ * soon as all their bytes are available.
+ *
+ * Input is framed with mp_scan_element(): the state to resume the scan
+ * is just the position of the next header and the number of elements still
+ * missing, so bytes are examined only once no matter how many chunks an
+ * object is split into. Once an object is complete it is decoded with the
+ * normal decoder.
+ *
+ * When there is nothing buffered the chunk is read in place, and only its
+ * unconsumed tail (a partial object) is copied into the internal buffer
+ * when the next chunk arrives. The buffered bytes are moved to the start
+ * of the buffer only when more room is needed.
+ *
+ * Objects are decoded straight from the buffer or the chunk, so the
+ * unpacker is busy while decoding: ext decoders can't feed it or take
+ * objects from it. */
+
+#define LUACMSGPACK_UNPACKER_MT "cmsgpack.unpacker"
+
+typedef struct mp_unpacker {
+    mp_buf buf;                 /* Buffered input, used if 'chunk' is NULL. */
+    const unsigned char *chunk; /* Input read in place, or NULL. */
+    size_t chunklen;
+    int chunkref;               /* Registry reference anchoring 'chunk'. */
+    size_t off;                 /* Start of the first unconsumed object. */
+    size_t scan;                /* Next header to examine. */
+    uint64_t pending;           /* Elements missing to complete the object. */
+    int busy;                   /* Decoding an object. */
+    mp_opts opts;
+} mp_unpacker;
+
+/* Check that the argument 1 is an unpacker that is not decoding. */
+static mp_unpacker *mp_unpacker_check(lua_State *L) {
+    mp_unpacker *u = luaL_checkudata(L,1,LUACMSGPACK_UNPACKER_MT);
+
+    if (u->busy) luaL_error(L,"The unpacker can't be used while decoding.");
+    return u;
+}
+
+static void mp_unpacker_data(mp_unpacker *u, const unsigned char **p,
+                             size_t *len)
+{
+    if (u->chunk) {
+        *p = u->chunk;
+        *len = u->chunklen;
+    } else {
+        *p = u->buf.b;
+        *len = u->buf.len;
+    }
+}
+
+/* Drop the input in place, if any. Unconsumed bytes are lost. */
+static void mp_unpacker_unref(lua_State *L, mp_unpacker *u) {
+    if (u->chunk == NULL) return;
+    luaL_unref(L,LUA_REGISTRYINDEX,u->chunkref);
+    u->chunk = NULL;
+    u->chunkref = LUA_NOREF;
+}
+
+/* Drop all the input fed and not yet returned. */
+static void mp_unpacker_clear(lua_State *L, mp_unpacker *u) {
+    mp_unpacker_unref(L,u);
+    u->buf.free += u->buf.len;
+    u->buf.len = 0;
+    u->off = u->scan = 0;
+    u->pending = 0;
+}
+
+/* cmsgpack.unpacker() / codec:unpacker() */
+static int mp_unpacker_new(lua_State *L) {
+    mp_codec *codec = mp_codec_get(L);
+    mp_unpacker *u = lua_newuserdata(L,sizeof(*u));
+
+    mp_buf_init(L,&u->buf);
+    u->chunk = NULL;
+    u->chunklen = 0;
+    u->chunkref = LUA_NOREF;
+    u->off = u->scan = 0;
+    u->pending = 0;
+    u->busy = 0;
+    u->opts = codec->opts;
+    luaL_getmetatable(L,LUACMSGPACK_UNPACKER_MT);
+    lua_setmetatable(L,-2);
+    return 1;
+}
+
+/* unpacker:feed(chunk) */
+static int mp_unpacker_feed(lua_State *L) {
+    mp_unpacker *u = mp_unpacker_check(L);
+    size_t len;
+    const char *s = luaL_checklstring(L,2,&len);
+
+    if (len == 0) return 0;
+    if (u->chunk) {
+        /* Move the partial object left in the chunk into the buffer, that
+         * is empty while reading in place. */
+        mp_buf_append(&u->buf,u->chunk+u->off,u->chunklen-u->off);
+        u->scan -= u->off;
+        u->off = 0;
+        mp_unpacker_unref(L,u);
+    } else if (u->off == u->buf.len) {
+        /* Nothing buffered: read this chunk in place. */
+        u->buf.free += u->buf.len;
+        u->buf.len = 0;
+        u->off = u->scan = 0;
+        lua_pushvalue(L,2);
+        u->chunkref = luaL_ref(L,LUA_REGISTRYINDEX);
+        u->chunk = (const unsigned char*)s;
+        u->chunklen = len;
+        return 0;
+    } else if (u->off && u->buf.free < len) {
+        memmove(u->buf.b,u->buf.b+u->off,u->buf.len-u->off);
+        u->buf.free += u->off;
+        u->buf.len -= u->off;
+        u->scan -= u->off;
+        u->off = 0;
+    }
+    mp_buf_append(&u->buf,(const unsigned char*)s,len);
+    if (u->buf.err) {
+        u->buf.err = MP_BUF_ERROR_NONE;
+        lua_pushstring(L,"Out of memory while buffering input.");
+        lua_error(L);
+    }
+    return 0;
+}
+
+/* Decode the object starting at the offset 2 of the unpacker at 1, ending
+ * at u->off. Called in protected mode by unpacker:next(). */
+static int mp_unpacker_decode(lua_State *L) {
+    mp_unpacker *u = lua_touserdata(L,1);
+    size_t start = (size_t)lua_tointeger(L,2), len;
+    const unsigned char *p;
+    mp_cur c;
+
+    mp_unpacker_data(u,&p,&len);
+    mp_cur_init(&c,p+start,u->off-start);
+    c.opts = &u->opts;
+    mp_decode_to_lua_type(L,&c);
+    mp_cur_check(L,&c);
+    return 1;
+}
+
+/* unpacker:next() -- Return true and the next object, or nothing if no
+ * complete object is available yet. This allows to iterate with:
+ *
+ *     for _, obj in unpacker.next, unpacker do ... end
+ *
+ * Input that is not MessagePack is dropped, since there is no way to find
+ * where the next object starts. */
+static int mp_unpacker_next(lua_State *L) {
+    mp_unpacker *u = mp_unpacker_check(L);
+    const unsigned char *p;
+    size_t len, elen, start;
+    uint64_t count;
+    int err;
+
+    mp_unpacker_data(u,&p,&len);
+    if (u->pending == 0) {
+        if (u->off == len) return 0;
+        u->scan = u->off;
+        u->pending = 1;
+    }
+    while(u->pending) {
+        err = mp_scan_element(p+u->scan,len-u->scan,&elen,&count);
+        if (err == MP_CUR_ERROR_EOF) return 0;
+        if (err != MP_CUR_ERROR_NONE) mp_unpacker_clear(L,u);
+        mp_scan_check(L,err);
+        u->scan += elen;
+        u->pending += count-1;
+    }
+
+    /* The object is consumed before decoding it, so that an object that
+     * fails to decode does not block the stream. */
+    start = u->off;
+    u->off = u->scan;
+    lua_settop(L,1);
+    lua_pushboolean(L,1);
+    lua_pushvalue(L,1);
+    lua_pushinteger(L,(lua_Integer)start);
+    u->busy = 1;
+    err = mp_pcall(L,mp_unpacker_decode,2,1);
+    u->busy = 0;
+    if (err) lua_error(L);
+    if (u->off == len) mp_unpacker_clear(L,u);
+    return 2;
+}
+
+/* unpacker:reset() -- Drop all the input fed and not yet returned, to
+ * start again with a new stream. */
+static int mp_unpacker_reset(lua_State *L) {
+    mp_unpacker_clear(L,mp_unpacker_check(L));
+    return 0;
+}
+
+/* unpacker:buffered() -- Number of bytes fed but not yet returned. */
+static int mp_unpacker_buffered(lua_State *L) {
+    mp_unpacker *u = luaL_checkudata(L,1,LUACMSGPACK_UNPACKER_MT);
+    const unsigned char *p;
+    size_t len;
+
+    mp_unpacker_data(u,&p,&len);
+    lua_pushinteger(L,(lua_Integer)(len-u->off));
+    return 1;
+}
+
+static int mp_unpacker_gc(lua_State *L) {
+    mp_unpacker *u = luaL_checkudata(L,1,LUACMSGPACK_UNPACKER_MT);
+
+    mp_unpacker_unref(L,u);
+    mp_buf_free(&u->buf);
+    return 0;
+}
+
+/* ------------------------------ Streaming packer -----------------------------
+ * cmsgpack.packer(sink) returns an object that encodes values into a
+ * buffer of fixed size, that is handed to the sink every time it fills up,
+ * so that the output is never held in memory all at once. The sink can be
+ * a Lua function, called with every chunk, a Lua file, or a file
+ * descriptor, written directly with fwrite() and write().
+ *
+ * A table is encoded with a header placeholder patched at the end, so the
+ * buffer can only be flushed between top level values: for output of
+ * bounded size huge collections are emitted element by element, after a
+ * header written by array_begin(n) or map_begin(n).
+ *
+ * Hooks called while encoding and the sink function can't use the packer:
+ * the packer is busy until the value is complete or the sink returns. A
+ * value that raises a Lua error half way is dropped from the buffer. */
+
+#define LUACMSGPACK_PACKER_MT   "cmsgpack.packer"
+#define LUACMSGPACK_FLUSH_BYTES 65536   /* Default buffer size. */
+
+#define MP_SINK_FUNCTION    0
+#define MP_SINK_FILE        1
+#define MP_SINK_FD          2
+
+typedef struct mp_packer {
+    mp_buf buf;
+    mp_codec *codec;    /* Codec whose options are used. */
+    int codecref;       /* Registry reference anchoring 'codec'. */
+    int sink;           /* One of MP_SINK_*. */
+    int sinkref;        /* Registry reference of the function or file. */
+    int fd;
+    size_t flush_bytes;
+    uint64_t flushed;   /* Bytes handed to the sink so far. */
+    int busy;           /* Encoding, or calling the sink. */
+} mp_packer;
+
+static lua_Integer mp_opt_integer(lua_State *L, int idx, const char *name,
+                                  lua_Integer def);
+
+/* Return the FILE of a file sink, raising an error if the file was closed.
+ * Lua 5.2+ io.close() does not clear 'f', it sets 'closef' to NULL. */
+static FILE *mp_packer_file(lua_State *L, mp_packer *pk) {
+    FILE *fp;
+    void *ud;
+
+    lua_rawgeti(L,LUA_REGISTRYINDEX,pk->sinkref);
+    ud = lua_touserdata(L,-1);
+    lua_pop(L,1);
+#if LUA_VERSION_NUM < 502
+    fp = *(FILE**)ud;
+#else
+    fp = ((luaL_Stream*)ud)->closef ? ((luaL_Stream*)ud)->f : NULL;
+#endif
+    if (fp == NULL) luaL_error(L,"attempt to use a closed file");
+    return fp;
+}
+
+/* Hand the buffered bytes to the sink. Errors of the sink are raised, the
+ * bytes are then kept to be written again by the next flush. */
+static void mp_packer_flush(lua_State *L, mp_packer *pk) {
+    mp_buf *buf = &pk->buf;
+    size_t off = 0;
+    FILE *fp;
+    int err;
+
+    if (buf->len == 0) return;
+    switch(pk->sink) {
+    case MP_SINK_FUNCTION:
+        lua_rawgeti(L,LUA_REGISTRYINDEX,pk->sinkref);
+        lua_pushlstring(L,(char*)buf->b,buf->len);
+        pk->busy = 1;
+        err = lua_pcall(L,1,0,0);
+        pk->busy = 0;
+        if (err) lua_error(L);
+        break;
+    case MP_SINK_FILE:
+        fp = mp_packer_file(L,pk);
+        if (fwrite(buf->b,1,buf->len,fp) != buf->len)
+            luaL_error(L,"write error: %s",strerror(errno));
+        break;
+    case MP_SINK_FD:
+        while(off < buf->len) {
+#ifdef _WIN32
+            int n = _write(pk->fd,buf->b+off,(unsigned int)(buf->len-off));
+#else
+            ssize_t n = write(pk->fd,buf->b+off,buf->len-off);
+#endif
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                /* What was written is gone from the buffer. */
+                memmove(buf->b,buf->b+off,buf->len-off);
+                buf->free += off;
+                buf->len -= off;
+                pk->flushed += off;
+                luaL_error(L,"write error: %s",strerror(errno));
+            }
+            off += (size_t)n;
+        }
+        break;
+    }
+    pk->flushed += buf->len;
+    buf->free += buf->len;
+    buf->len = 0;
+    /* Give back the memory of elements bigger than the buffer. */
+    if (buf->free > pk->flush_bytes*2) mp_buf_resize(buf,pk->flush_bytes);
+}
+
+/* Check that the argument 1 is a packer that is not busy. */
+static mp_packer *mp_packer_check(lua_State *L) {
+    mp_packer *pk = luaL_checkudata(L,1,LUACMSGPACK_PACKER_MT);
+
+    if (pk->busy) luaL_error(L,"The packer is busy.");
+    return pk;
+}
+
+/* Get the buffer ready to encode, like mp_codec_acquire() does. */
+static mp_packer *mp_packer_get(lua_State *L) {
+    mp_packer *pk = mp_packer_check(L);
+    mp_buf *buf = &pk->buf;
+
+    buf->memo = pk->codec->memo;
+    buf->max_depth = pk->codec->opts.max_depth;
+    buf->refs.mode = pk->codec->opts.refs;
+    buf->bin = pk->codec->opts.strings == MP_STRINGS_BIN;
+    return pk;
+}
+
+/* Flush if the buffer is full, or raise the error of the last encoding
+ * dropping what was encoded since 'pos'. */
+static void mp_packer_done(lua_State *L, mp_packer *pk, size_t pos) {
+    mp_buf *buf = &pk->buf;
+
+    if (buf->err != MP_BUF_ERROR_NONE) {
+        buf->free += buf->len-pos;
+        buf->len = pos;
+        mp_buf_pusherror(L,buf);
+        lua_error(L);
+    }
+    if (buf->len >= pk->flush_bytes) mp_packer_flush(L,pk);
+}
+
+/* cmsgpack.packer(sink [, opts]) / codec:packer(sink [, opts]) -- The sink
+ * is a function, a file or a file descriptor. The only option is
+ * 'flush_bytes', the size of the buffer. */
+static int mp_packer_new(lua_State *L) {
+    int arg = mp_codec_firstarg(L);
+    mp_codec *codec = mp_codec_get(L);
+    mp_packer *pk;
+    size_t flush_bytes = LUACMSGPACK_FLUSH_BYTES;
+    int sink;
+
+    if (lua_type(L,arg) == LUA_TFUNCTION) {
+        sink = MP_SINK_FUNCTION;
+    } else if (lua_type(L,arg) == LUA_TNUMBER) {
+        sink = MP_SINK_FD;
+    } else {
+        luaL_checkudata(L,arg,LUA_FILEHANDLE);
+        sink = MP_SINK_FILE;
+    }
+    if (!lua_isnoneornil(L,arg+1)) {
+        luaL_checktype(L,arg+1,LUA_TTABLE);
+        flush_bytes = mp_opt_integer(L,arg+1,"flush_bytes",flush_bytes);
+        luaL_argcheck(L,flush_bytes > 0,arg+1,"flush_bytes must be > 0");
+    }
+    pk = lua_newuserdata(L,sizeof(*pk));
+    mp_buf_init(L,&pk->buf);
+    pk->codec = codec;
+    pk->codecref = LUA_NOREF;
+    pk->sink = sink;
+    pk->sinkref = LUA_NOREF;
+    pk->fd = sink == MP_SINK_FD ? (int)lua_tointeger(L,arg) : -1;
+    pk->flush_bytes = flush_bytes;
+    pk->flushed = 0;
+    pk->busy = 0;
+    luaL_getmetatable(L,LUACMSGPACK_PACKER_MT);
+    lua_setmetatable(L,-2);
+    if (arg == 1)
+        lua_pushvalue(L,lua_upvalueindex(1));
+    else
+        lua_pushvalue(L,1);
+    pk->codecref = luaL_ref(L,LUA_REGISTRYINDEX);
+    if (sink != MP_SINK_FD) {
+        lua_pushvalue(L,arg);
+        pk->sinkref = luaL_ref(L,LUA_REGISTRYINDEX);
+    }
+    mp_buf_resize(&pk->buf,flush_bytes);
+    return 1;
+}
+
+/* Protected part of packer:pack(), called with the packer as light
+ * userdata and the value. */
+static int mp_packer_encode(lua_State *L) {
+    mp_encode_lua_type(L,&((mp_packer*)lua_touserdata(L,1))->buf,0);
+    return 0;
+}
+
+/* packer:pack(...) -- Encode the values one after the other. Only tables
+ * and userdata can run Lua code or raise Lua errors while encoding, so
+ * only they are encoded in protected mode. */
+static int mp_packer_pack(lua_State *L) {
+    mp_packer *pk = mp_packer_get(L);
+    mp_buf *buf = &pk->buf;
+    int nargs = lua_gettop(L), j, t;
+    size_t pos;
+
+    for (j = 2; j <= nargs; j++) {
+        pos = buf->len;
+        t = lua_type(L,j);
+        if (t != LUA_TTABLE && t != LUA_TUSERDATA) {
+            lua_pushvalue(L,j);
+            mp_encode_lua_type(L,buf,0);
+        } else {
+            lua_pushlightuserdata(L,pk);
+            lua_pushvalue(L,j);
+            pk->busy = 1;
+            t = mp_pcall(L,mp_packer_encode,2,0);
+            pk->busy = 0;
+            if (t != 0) {
+                buf->free += buf->len-pos;
+                buf->len = pos;
+                buf->err = MP_BUF_ERROR_NONE;
+                lua_error(L);
+            }
+        }
+        mp_packer_done(L,pk,pos);
+    }
+    return 0;
+}
+
+/* packer:array_begin(n) / packer:map_begin(n) -- Emit the header of an
+ * array of 'n' elements, or of a map of 'n' pairs, that must follow. */
+static int mp_packer_begin(lua_State *L, int map) {
+    mp_packer *pk = mp_packer_get(L);
+    lua_Integer n = luaL_checkinteger(L,2);
+    size_t pos = pk->buf.len;
+
+    luaL_argcheck(L,n >= 0 && (uint64_t)n <= 0xffffffffU,2,
+                  "size out of range");
+    if (map)
+        mp_encode_map(&pk->buf,n);
+    else
+        mp_encode_array(&pk->buf,n);
+    mp_packer_done(L,pk,pos);
+    return 0;
+}
+
+static int mp_packer_array_begin(lua_State *L) {
+    return mp_packer_begin(L,0);
+}
+
+static int mp_packer_map_begin(lua_State *L) {
+    return mp_packer_begin(L,1);
+}
+
+/* packer:flush() -- Hand everything buffered to the sink. */
+static int mp_packer_flush_lua(lua_State *L) {
+    mp_packer *pk = mp_packer_check(L);
+
+    mp_packer_flush(L,pk);
+    if (pk->sink == MP_SINK_FILE) fflush(mp_packer_file(L,pk));
+    return 0;
+}
+
+/* packer:bytes() -- Bytes emitted so far, flushed or not. */
+static int mp_packer_bytes(lua_State *L) {
+    mp_packer *pk = luaL_checkudata(L,1,LUACMSGPACK_PACKER_MT);
+
+    lua_pushnumber(L,(lua_Number)(pk->flushed+pk->buf.len));
+    return 1;
+}
+
+static int mp_packer_gc(lua_State *L) {
+    mp_packer *pk = luaL_checkudata(L,1,LUACMSGPACK_PACKER_MT);
+
+    mp_buf_free(&pk->buf);
+    luaL_unref(L,LUA_REGISTRYINDEX,pk->sinkref);
+    luaL_unref(L,LUA_REGISTRYINDEX,pk->codecref);
+    pk->sinkref = pk->codecref = LUA_NOREF;
+    return 0;
+}
+
+/* ------------------------------ Resumable jobs -------------------------------
+ * cmsgpack.encoder(obj [, budget]) and cmsgpack.decoder(s [, budget]) return
+ * a job that encodes or decodes a single object a slice at a time, so that
+ * huge payloads do not stall the program for long: job:step() processes
+ * about 'budget' bytes of output (or of input), then returns false, or true
+ * and the result once the job is done. job:run() steps until the end and,
+ * on Lua 5.2 and newer, when called from a coroutine yields after every
+ * step, so that a scheduler can do other work in the meantime.
+ *
+ * The walk is the one of mp_encode_lua_type() and mp_decode_to_lua_type(),
+ * but its state must survive across calls: the frames are kept in the job,
+ * and the values the walk leaves on the Lua stack (the tables visited and
+ * their keys) are moved to a table between steps. Tables must not be
+ * modified while a job is encoding them. */
+
+#define LUACMSGPACK_JOB_MT      "cmsgpack.job"
+#define LUACMSGPACK_JOB_BUDGET  65536   /* Default bytes for every step. */
+
+#define MP_JOB_ENCODE   0
+#define MP_JOB_DECODE   1
+
+typedef struct mp_job {
+    int kind;           /* MP_JOB_ENCODE or MP_JOB_DECODE. */
+    int state;          /* 0 running, 1 done, -1 failed. */
+    size_t budget;
+    mp_codec *codec;    /* Codec whose options are used. */
+    int codecref;       /* Registry reference anchoring 'codec'. */
+    int stackref;       /* Table of the values of the walk between steps. */
+    int nstack;         /* Values in it, the result once done. */
+    int srcref;         /* Input of a decoder. */
+    size_t off;         /* Input consumed by a decoder. */
+    size_t nrefs;       /* Tables stored by a decoder in "dedupe" mode. */
+    void *frames;       /* mp_enc_frame or mp_dec_frame. */
+    int top, cap;
+    mp_buf buf;         /* Output of an encoder. */
+} mp_job;
+
+/* Make room for one more frame of 'size' bytes. */
+static int mp_job_grow(mp_job *job, size_t size) {
+    int cap = job->cap ? job->cap*2 : LUACMSGPACK_INLINE_FRAMES;
+    void *nf;
+
+    if (job->top < job->cap) return 1;
+    nf = job->buf.alloc(job->buf.ud,job->frames,size*job->cap,size*cap);
+    if (nf == NULL) return 0;
+    job->frames = nf;
+    job->cap = cap;
+    return 1;
+}
+
+static void mp_job_free(mp_job *job) {
+    size_t size = job->kind == MP_JOB_ENCODE ? sizeof(mp_enc_frame) :
+                                               sizeof(mp_dec_frame);
+
+    if (job->frames) job->buf.alloc(job->buf.ud,job->frames,size*job->cap,0);
+    job->frames = NULL;
+    job->top = job->cap = 0;
+    mp_buf_free(&job->buf);
+}
+
+/* Encoding step, with the value to emit on top of the stack. Returns 1
+ * when the object is done, 0 when the budget is over, leaving the next
+ * value to emit on top, or -1 on error. */
+static int mp_job_encode(lua_State *L, mp_job *job) {
+    mp_buf *buf = &job->buf;
+    mp_enc_frame *frames = job->frames;
+
+    buf->mark = buf->len+job->budget;
+    for (;;) {
+        if (buf->len >= buf->mark) return 0;
+        switch(lua_type(L,-1)) {
+        case LUA_TSTRING: mp_encode_lua_string(L,buf); break;
+        case LUA_TBOOLEAN: mp_encode_lua_bool(L,buf); break;
+        case LUA_TNUMBER: mp_encode_lua_number(L,buf); break;
+        case LUA_TUSERDATA: mp_encode_lua_userdata(L,buf); break;
+        case LUA_TTABLE:
+            if (buf->refs.mode != MP_REFS_OFF && mp_encode_lua_ref(L,buf)) {
+                if (buf->err) return -1;
+                break;
+            }
+            if (buf->memo != LUA_NOREF && mp_encode_lua_frozen(L,buf)) {
+                mp_encode_ref_done(buf,lua_topointer(L,-1));
+                break;
+            }
+            if (job->top >= buf->max_depth || !lua_checkstack(L,8)) {
+                buf->err = MP_BUF_ERROR_DEPTH;
+                return -1;
+            }
+            if (!mp_job_grow(job,sizeof(*frames))) {
+                buf->err = MP_BUF_ERROR_OOM;
+                return -1;
+            }
+            frames = job->frames;
+            mp_encode_table_begin(L,buf,&frames[job->top++]);
+            goto next;
+        default: mp_encode_lua_null(L,buf); break;
+        }
+        if (buf->err) return -1;
+        lua_pop(L,1);
+
+next:   while(job->top && !mp_encode_table_next(L,buf,&frames[job->top-1])) {
+            job->top--;
+            mp_encode_ref_done(buf,frames[job->top].table);
+        }
+        if (buf->err) return -1;
+        if (job->top == 0) return 1;
+    }
+}
+
+/* Like mp_decode_scalars(), consuming at most 'max' bytes. */
+static void mp_job_scalars(lua_State *L, mp_cur *c, mp_dec_frame *f,
+                           size_t max)
+{
+    size_t rest = 0;
+
+    if (c->left > max) {
+        rest = c->left-max;
+        c->left = max;
+    }
+    mp_decode_scalars(L,c,f);
+    c->left += rest;
+}
+
+/* Decoding step. The table of the refs, or false, is at 'base', the tables
+ * being filled follow. Returns 1 when the object is done and on top of the
+ * stack, 0 when the budget is over, or -1 on error. */
+static int mp_job_decode(lua_State *L, mp_job *job, mp_cur *c, int base) {
+    mp_dec_frame *frames = job->frames, *f;
+    size_t start = c->left, count, used;
+    int kind;
+
+    for (;;) {
+        used = start-c->left;
+        if (used >= job->budget) return 0;
+        if (!lua_checkstack(L,8)) {
+            c->err = MP_CUR_ERROR_DEPTH;
+            return -1;
+        }
+        mp_decode_element(L,c,&kind,&count);
+        if (c->err) return -1;
+        if (kind == MP_DEC_REF) {
+            if (count >= job->nrefs) {
+                c->err = MP_CUR_ERROR_BADFMT;
+                return -1;
+            }
+            lua_rawgeti(L,base,(int)count+1);
+        } else if (kind != MP_DEC_SCALAR) {
+            if (c->opts->refs == MP_REFS_DEDUPE) {
+                lua_pushvalue(L,-1);
+                lua_rawseti(L,base,(int)++job->nrefs);
+            }
+            if (job->top >= c->opts->max_depth) {
+                c->err = MP_CUR_ERROR_DEPTH;
+                return -1;
+            }
+            if (count) {
+                if (!mp_job_grow(job,sizeof(*frames)))
+                    luaL_error(L,"not enough memory");
+                frames = job->frames;
+                f = &frames[job->top++];
+                f->map = kind == MP_DEC_MAP;
+                f->left = f->map ? count*2 : count;
+                f->index = 1;
+                used = start-c->left;
+                if (used < job->budget)
+                    mp_job_scalars(L,c,f,job->budget-used);
+                if (f->left) continue;
+                job->top--;
+            }
+        }
+
+        /* Store the value into the enclosing tables that are complete. */
+        while(job->top) {
+            f = &frames[job->top-1];
+            f->left--;
+            if (!f->map)
+                lua_rawseti(L,-2,f->index++);
+            else if (!(f->left & 1))
+                lua_rawset(L,-3);
+            used = start-c->left;
+            if (used < job->budget)
+                mp_job_scalars(L,c,f,job->budget-used);
+            if (f->left) break;
+            job->top--;
+        }
+        if (job->top == 0) return 1;
+    }
+}
+
+/* Run a step of the job. The values of the walk are brought back on the
+ * stack, and saved again when the budget is over. Errors are raised, and
+ * leave the job failed. Returns 1 if the job is done. */
+static int mp_job_step(lua_State *L, mp_job *job) {
+    int top = lua_gettop(L), stk, base, n, j, res = 0;
+    const unsigned char *s;
+    size_t len;
+    mp_cur c;
+
+    if (job->state == 1) return 1;
+    if (job->state < 0) luaL_error(L,"the job failed");
+    luaL_checkstack(L,job->nstack+16,"too many nested tables");
+    job->state = -1; /* Until the step is over. */
+    lua_rawgeti(L,LUA_REGISTRYINDEX,job->stackref);
+    stk = top+1;
+    if (job->kind == MP_JOB_DECODE)
+        lua_rawgeti(L,LUA_REGISTRYINDEX,job->srcref);
+    base = lua_gettop(L)+1;
+    for (j = 1; j <= job->nstack; j++) lua_rawgeti(L,stk,j);
+
+    if (job->kind == MP_JOB_ENCODE) {
+        res = mp_job_encode(L,job);
+        if (res < 0) {
+            lua_settop(L,top);
+            mp_buf_pusherror(L,&job->buf);
+            lua_error(L);
+        }
+        if (res) lua_pushlstring(L,(char*)job->buf.b,job->buf.len);
+    } else {
+        s = (const unsigned char*) mp_tobytes(L,base-1,&len);
+        mp_cur_init(&c,s+job->off,len-job->off);
+        c.opts = &job->codec->opts;
+        c.src = base-1;
+        res = mp_job_decode(L,job,&c,base);
+        if (res < 0) {
+            lua_settop(L,top);
+            mp_cur_check(L,&c);
+        }
+        job->off = len-c.left;
+        if (res) {
+            if (c.left != 0) luaL_error(L,"Extra bytes in input.");
+            lua_remove(L,base);
+        }
+    }
+
+    /* Save the values for the next step, or the result when done. */
+    n = lua_gettop(L)-base+1;
+    for (j = n; j >= 1; j--) lua_rawseti(L,stk,j);
+    for (j = n+1; j <= job->nstack; j++) {
+        lua_pushnil(L);
+        lua_rawseti(L,stk,j);
+    }
+    job->nstack = n;
+    job->state = res;
+    if (res) mp_job_free(job);
+    lua_settop(L,top);
+    return res;
+}
+
+/* cmsgpack.encoder(obj [, budget]) / cmsgpack.decoder(s [, budget]) and
+ * the codec methods with the same names. */
+static int mp_job_new(lua_State *L, int kind) {
+    int arg = mp_codec_firstarg(L);
+    mp_codec *codec = mp_codec_get(L);
+    lua_Integer budget = luaL_optinteger(L,arg+1,LUACMSGPACK_JOB_BUDGET);
+    size_t len;
+    mp_job *job;
+
+    if (kind == MP_JOB_ENCODE)
+        luaL_checkany(L,arg);
+    else
+        mp_checkbytes(L,arg,&len);
+    luaL_argcheck(L,budget > 0,arg+1,"budget must be > 0");
+    job = lua_newuserdata(L,sizeof(*job));
+    job->kind = kind;
+    job->state = 0;
+    job->budget = (size_t)budget;
+    job->codec = codec;
+    job->codecref = job->stackref = job->srcref = LUA_NOREF;
+    job->off = job->nrefs = 0;
+    job->frames = NULL;
+    job->top = job->cap = 0;
+    mp_buf_init(L,&job->buf);
+    luaL_getmetatable(L,LUACMSGPACK_JOB_MT);
+    lua_setmetatable(L,-2);
+    if (arg == 1)
+        lua_pushvalue(L,lua_upvalueindex(1));
+    else
+        lua_pushvalue(L,1);
+    job->codecref = luaL_ref(L,LUA_REGISTRYINDEX);
+
+    /* The walk starts with the object to encode, or with the table of the
+     * refs of the decoder, if needed. */
+    lua_newtable(L);
+    if (kind == MP_JOB_ENCODE) {
+        job->buf.memo = codec->memo;
+        job->buf.max_depth = codec->opts.max_depth;
+        job->buf.refs.mode = codec->opts.refs;
+        job->buf.bin = codec->opts.strings == MP_STRINGS_BIN;
+        if (job->buf.refs.mode != MP_REFS_OFF) mp_refs_reset(&job->buf);
+        lua_pushvalue(L,arg);
+    } else {
+        if (codec->opts.refs == MP_REFS_DEDUPE)
+            lua_newtable(L);
+        else
+            lua_pushboolean(L,0);
+        lua_pushvalue(L,arg);
+        job->srcref = luaL_ref(L,LUA_REGISTRYINDEX);
+    }
+    lua_rawseti(L,-2,1);
+    job->nstack = 1;
+    job->stackref = luaL_ref(L,LUA_REGISTRYINDEX);
+    return 1;
+}
+
+static int mp_encoder_new(lua_State *L) {
+    return mp_job_new(L,MP_JOB_ENCODE);
+}
+
+static int mp_decoder_new(lua_State *L) {
+    return mp_job_new(L,MP_JOB_DECODE);
+}
+
+/* Push the result of a job that is done. */
+static void mp_job_result(lua_State *L, mp_job *job) {
+    lua_rawgeti(L,LUA_REGISTRYINDEX,job->stackref);
+    lua_rawgeti(L,-1,1);
+    lua_remove(L,-2);
+}
+
+/* job:step() -- Returns false if there is more to do, otherwise true and
+ * the result. */
+static int mp_job_step_lua(lua_State *L) {
+    mp_job *job = luaL_checkudata(L,1,LUACMSGPACK_JOB_MT);
+
+    if (!mp_job_step(L,job)) {
+        lua_pushboolean(L,0);
+        return 1;
+    }
+    lua_pushboolean(L,1);
+    mp_job_result(L,job);
+    return 2;
+}
+
+/* job:run() -- Step until the job is done and return the result. Inside a
+ * coroutine, yield (with no values) after every step. Lua 5.2 can not tell
+ * if there is a C call in the way, and then yielding raises an error. */
+static int mp_job_run(lua_State *L);
+
+#if LUA_VERSION_NUM >= 503
+static int mp_job_run_k(lua_State *L, int status, lua_KContext ctx) {
+    (void)status;
+    (void)ctx;
+    return mp_job_run(L);
+}
+#elif LUA_VERSION_NUM == 502
+static int mp_job_run_k(lua_State *L) {
+    return mp_job_run(L);
+}
+#endif
+
+static int mp_job_run(lua_State *L) {
+    mp_job *job = luaL_checkudata(L,1,LUACMSGPACK_JOB_MT);
+#if LUA_VERSION_NUM == 502
+    int ismain;
+#endif
+
+    lua_settop(L,1); /* Drop the values resume() passed back. */
+    while(!mp_job_step(L,job)) {
+#if LUA_VERSION_NUM >= 503
+        if (lua_isyieldable(L)) return lua_yieldk(L,0,0,mp_job_run_k);
+#elif LUA_VERSION_NUM == 502
+        ismain = lua_pushthread(L);
+        lua_pop(L,1);
+        if (!ismain) return lua_yieldk(L,0,0,mp_job_run_k);
+#endif
+    }
+    mp_job_result(L,job);
+    return 1;
+}
+
+static int mp_job_gc(lua_State *L) {
+    mp_job *job = luaL_checkudata(L,1,LUACMSGPACK_JOB_MT);
+
+    mp_job_free(job);
+    luaL_unref(L,LUA_REGISTRYINDEX,job->stackref);
+    luaL_unref(L,LUA_REGISTRYINDEX,job->srcref);
+    luaL_unref(L,LUA_REGISTRYINDEX,job->codecref);
+    job->stackref = job->srcref = job->codecref = LUA_NOREF;
+    return 0;
+}
+
+/* -------------------------------- Lazy views --------------------------------
+ * cmsgpack.view(s) returns an object that reads the arrays and maps encoded
+ * in 's' in place: indexing it decodes just the requested element, and
+ * nested arrays and maps are returned as views as well. This is much
+ * cheaper than unpack() when only a few fields of a big message are needed.
+ *
+ * The whole input is walked with mp_skip_object() when the view is
+ * created, so that views never meet truncated or malformed data later.
+ * Finding an element still requires to skip the elements before it, so
+ * accessing every element by index is quadratic: pairs() should be used
+ * to visit all of them. */
+
+#define LUACMSGPACK_VIEW_MT "cmsgpack.view"
+
+typedef struct mp_view {
+    const unsigned char *p;     /* Header of the array or map. */
+    size_t len;                 /* Size of the whole array or map. */
+    size_t hdr;                 /* Size of the header. */
+    uint64_t count;             /* Elements, keys and values for maps. */
+    int map;
+    int ref;                    /* Registry reference anchoring 'p'. */
+    mp_opts opts;
+} mp_view;
+
+/* Push the element at 'p', that is 'len' bytes long and known to be
+ * valid: scalars are decoded, arrays and maps become views of the input
+ * string, that is at stack index 'src'. */
+static void mp_view_push(lua_State *L, int src, const mp_opts *opts,
+                         const unsigned char *p, size_t len)
+{
+    if (mp_is_container(p[0])) {
+        mp_view *v = lua_newuserdata(L,sizeof(*v));
+
+        v->ref = LUA_NOREF;
+        luaL_getmetatable(L,LUACMSGPACK_VIEW_MT);
+        lua_setmetatable(L,-2);
+        v->p = p;
+        v->len = len;
+        mp_scan_element(p,len,&v->hdr,&v->count);
+        v->map = (p[0] & 0xf0) == 0x80 || p[0] == 0xde || p[0] == 0xdf;
+        v->opts = *opts;
+        lua_pushvalue(L,src);
+        v->ref = luaL_ref(L,LUA_REGISTRYINDEX);
+    } else {
+        mp_cur c;
+
+        mp_cur_init(&c,p,len);
+        c.opts = opts;
+        c.src = src;
+        mp_decode_to_lua_type(L,&c);
+        mp_cur_check(L,&c);
+    }
+}
+
+/* Return the size of the valid object at 'p', that is 'left' bytes long. */
+static size_t mp_view_skip(const unsigned char *p, size_t left) {
+    size_t len;
+
+    mp_skip_object(p,left,&len);
+    return len;
+}
+
+/* Compare the Lua value at 'idx' with the valid element at 'p', the same
+ * way lua_rawequal() would do with the decoded element. Strings are
+ * compared in place. */
+static int mp_key_equals(lua_State *L, const mp_opts *opts, int idx,
+                         const unsigned char *p, size_t len)
+{
+    size_t hdr = mp_str_header(p[0]);
+    int eq;
+    mp_cur c;
+
+    if (lua_type(L,idx) == LUA_TSTRING) {
+        size_t klen;
+        const char *k;
+
+        if (!hdr) return 0;
+        k = lua_tolstring(L,idx,&klen);
+        return klen == len-hdr && memcmp(k,p+hdr,klen) == 0;
+    }
+    if (hdr || mp_is_container(p[0])) return 0;
+    mp_cur_init(&c,p,len);
+    c.opts = opts;
+    mp_decode_to_lua_type(L,&c);
+    mp_cur_check(L,&c);
+    eq = lua_rawequal(L,idx,-1);
+    lua_pop(L,1);
+    return eq;
+}
+
+/* cmsgpack.view(s) / codec:view(s) -- Arrays and maps are returned as a
+ * view, other types are just decoded. */
+static int mp_view_new(lua_State *L) {
+    mp_codec *codec = mp_codec_get(L);
+    int arg = mp_codec_firstarg(L);
+    const unsigned char *s;
+    size_t len, olen;
+    mp_opts opts = codec->opts;
+
+    s = (const unsigned char*) luaL_checklstring(L,arg,&len);
+    mp_scan_check(L,mp_skip_object(s,len,&olen));
+    if (olen != len) {
+        lua_pushstring(L,"Extra bytes in input.");
+        lua_error(L);
+    }
+    opts.refs = MP_REFS_OFF; /* Elements are decoded one by one. */
+    mp_view_push(L,arg,&opts,s,len);
+    return 1;
+}
+
+/* view[key] -- Decode the element at 'key', nil if there is none. If a
+ * map has duplicated keys the first one is used. */
+static int mp_view_index(lua_State *L) {
+    mp_view *v = luaL_checkudata(L,1,LUACMSGPACK_VIEW_MT);
+    const unsigned char *p = v->p+v->hdr;
+    size_t left = v->len-v->hdr, klen, vlen;
+    uint64_t j;
+    int src;
+
+    lua_rawgeti(L,LUA_REGISTRYINDEX,v->ref);
+    src = lua_gettop(L);
+    if (!v->map) {
+        lua_Number n = lua_tonumber(L,2);
+
+        if (lua_type(L,2) != LUA_TNUMBER || n < 1 || n > (lua_Number)v->count
+            || n != (lua_Number)(uint64_t)n) return 0;
+        for (j = 1; j < (uint64_t)n; j++) {
+            klen = mp_view_skip(p,left);
+            p += klen;
+            left -= klen;
+        }
+        mp_view_push(L,src,&v->opts,p,mp_view_skip(p,left));
+        return 1;
+    }
+    for (j = 0; j < v->count; j += 2) {
+        klen = mp_view_skip(p,left);
+        vlen = mp_view_skip(p+klen,left-klen);
+        if (mp_key_equals(L,&v->opts,2,p,klen)) {
+            mp_view_push(L,src,&v->opts,p+klen,vlen);
+            return 1;
+        }
+        p += klen+vlen;
+        left -= klen+vlen;
+    }
+    return 0;
+}
+
+/* #view -- Number of elements of an array, or of pairs of a map. */
+static int mp_view_len(lua_State *L) {
+    mp_view *v = luaL_checkudata(L,1,LUACMSGPACK_VIEW_MT);
+
+    lua_pushinteger(L,(lua_Integer)(v->map ? v->count/2 : v->count));
+    return 1;
+}
+
+/* Iterator returned by pairs(view). The offset of the next element and
+ * the number of elements visited are kept as upvalues. */
+static int mp_view_next(lua_State *L) {
+    mp_view *v = lua_touserdata(L,lua_upvalueindex(1));
+    size_t off = (size_t)lua_tointeger(L,lua_upvalueindex(2)), len;
+    lua_Integer j = lua_tointeger(L,lua_upvalueindex(3));
+    int src;
+
+    if ((uint64_t)j >= v->count) return 0;
+    lua_rawgeti(L,LUA_REGISTRYINDEX,v->ref);
+    src = lua_gettop(L);
+    if (v->map) {
+        len = mp_view_skip(v->p+off,v->len-off);
+        mp_view_push(L,src,&v->opts,v->p+off,len);
+        off += len;
+        j++;
+    } else {
+        lua_pushinteger(L,j+1);
+    }
+    len = mp_view_skip(v->p+off,v->len-off);
+    mp_view_push(L,src,&v->opts,v->p+off,len);
+    lua_pushinteger(L,(lua_Integer)(off+len));
+    lua_replace(L,lua_upvalueindex(2));
+    lua_pushinteger(L,j+1);
+    lua_replace(L,lua_upvalueindex(3));
+    return 2;
+}
+
+/* pairs(view) -- Visit the elements in encoding order. Lua 5.1 does not
+ * honour __pairs, there the metamethod can be called directly. */
+static int mp_view_pairs(lua_State *L) {
+    mp_view *v = luaL_checkudata(L,1,LUACMSGPACK_VIEW_MT);
+
+    lua_pushvalue(L,1);
+    lua_pushinteger(L,(lua_Integer)v->hdr);
+    lua_pushinteger(L,0);
+    lua_pushcclosure(L,mp_view_next,3);
+    lua_pushvalue(L,1);
+    lua_pushnil(L);
+    return 3;
+}
+
+/* view() -- Decode the whole array or map, like unpack() would do. */
+static int mp_view_call(lua_State *L) {
+    mp_view *v = luaL_checkudata(L,1,LUACMSGPACK_VIEW_MT);
+    mp_cur c;
+
+    mp_cur_init(&c,v->p,v->len);
+    c.opts = &v->opts;
+    c.src = 1;
+    mp_decode_to_lua_type(L,&c);
+    mp_cur_check(L,&c);
+    return 1;
+}
+
+static int mp_view_gc(lua_State *L) {
+    mp_view *v = luaL_checkudata(L,1,LUACMSGPACK_VIEW_MT);
+
+    luaL_unref(L,LUA_REGISTRYINDEX,v->ref);
+    v->ref = LUA_NOREF;
+    return 0;
+}
+
+/* ---------------------------- Typed numeric arrays ----------------------------
+ * cmsgpack.array(type, t) creates a read only array of numbers of the given
+ * type, "f64", "f32", "i32" or "i64", backed by a contiguous C buffer. It
+ * is encoded as an ext of type LUACMSGPACK_ARRAY_EXT, whose payload is a
+ * byte with the type of the elements followed by the elements, big endian,
+ * and it is decoded back as a typed array: no Lua value is created for the
+ * elements, that are read from the buffer only when indexed.
+ *
+ * Big arrays decoded from a Lua string just point into the string, that is
+ * anchored with a registry reference like views do, while smaller ones get
+ * a copy of the elements. */
+
+#define LUACMSGPACK_ARRAY_MT    "cmsgpack.array"
+#define LUACMSGPACK_ARRAY_COPY  256 /* Max payload copied when decoding. */
+
+#define MP_ARRAY_F64    0
+#define MP_ARRAY_F32    1
+#define MP_ARRAY_I32    2
+#define MP_ARRAY_I64    3
+
+static const char *const mp_array_types[] = {"f64", "f32", "i32", "i64", NULL};
+static const size_t mp_array_size[] = {8, 4, 4, 8};
+
+typedef struct mp_array {
+    const unsigned char *p;     /* Elements, big endian. */
+    size_t len;                 /* Number of elements. */
+    int type;
+    int ref;                    /* Registry reference anchoring 'p', or
+                                   LUA_NOREF if the elements follow. */
+    unsigned char data[1];
+} mp_array;
+
+/* Push an array of 'len' elements. If 'src' is not zero the elements at
+ * 'p' are referenced, anchoring the value at 'src', otherwise they are
+ * copied (if 'p' is not NULL). */
+static mp_array *mp_array_push(lua_State *L, int type, size_t len,
+                               const unsigned char *p, int src)
+{
+    size_t bytes = len*mp_array_size[type];
+    mp_array *a = lua_newuserdata(L,sizeof(*a)+(src ? 0 : bytes));
+
+    a->ref = LUA_NOREF;
+    a->len = len;
+    a->type = type;
+    luaL_getmetatable(L,LUACMSGPACK_ARRAY_MT);
+    lua_setmetatable(L,-2);
+    if (src) {
+        a->p = p;
+        lua_pushvalue(L,src);
+        a->ref = luaL_ref(L,LUA_REGISTRYINDEX);
+    } else {
+        if (p) memcpy(a->data,p,bytes);
+        a->p = a->data;
+    }
+    return a;
+}
+
+/* Decode the ext payload of an array, 'len' bytes at 'p'. */
+static void mp_array_decode(lua_State *L, mp_cur *c, const unsigned char *p,
+                            size_t len)
+{
+    if (len < 1 || p[0] > MP_ARRAY_I64 || (len-1) % mp_array_size[p[0]]) {
+        c->err = MP_CUR_ERROR_BADFMT;
+        return;
+    }
+    mp_array_push(L,p[0],(len-1)/mp_array_size[p[0]],p+1,
+                  len > LUACMSGPACK_ARRAY_COPY ? c->src : 0);
+}
+
+static void mp_array_encode(mp_buf *buf, const mp_array *a) {
+    size_t bytes = a->len*mp_array_size[a->type];
+    unsigned char hdr[7];
+    int hdrlen = mp_ext_header(hdr,bytes+1,LUACMSGPACK_ARRAY_EXT);
+
+    hdr[hdrlen++] = a->type;
+    mp_buf_append(buf,hdr,hdrlen);
+    mp_buf_append(buf,a->p,bytes);
+    mp_stats_type(buf,hdr[0]);
+}
+
+/* Push the element at the 0-based index 'j'. */
+static void mp_array_get(lua_State *L, const mp_array *a, size_t j) {
+    const unsigned char *p = a->p+j*mp_array_size[a->type];
+
+    switch(a->type) {
+    case MP_ARRAY_F64: lua_pushnumber(L,mp_load_double(p)); break;
+    case MP_ARRAY_F32: lua_pushnumber(L,mp_load_float(p)); break;
+    case MP_ARRAY_I32: mp_push_int64(L,(int32_t)mp_load32(p)); break;
+    default: mp_push_int64(L,(int64_t)mp_load64(p)); break;
+    }
+}
+
+/* cmsgpack.array(type, t) -- Create an array with the elements of the
+ * sequence 't', that must be numbers representable with 'type'. */
+static int mp_array_new(lua_State *L) {
+    int type = luaL_checkoption(L,1,NULL,mp_array_types), i;
+    unsigned char *p;
+    mp_array *a;
+    size_t len;
+    lua_Number n;
+    double d;
+    float f;
+    uint32_t w;
+    uint64_t v;
+
+    luaL_checktype(L,2,LUA_TTABLE);
+#if LUA_VERSION_NUM < 502
+    len = lua_objlen(L,2);
+#else
+    len = lua_rawlen(L,2);
+#endif
+    a = mp_array_push(L,type,len,NULL,0);
+    p = a->data;
+    for (i = 1; (size_t)i <= len; i++) {
+        lua_rawgeti(L,2,i);
+        if (lua_type(L,-1) != LUA_TNUMBER)
+            return luaL_error(L,"array element %d is not a number",i);
+        n = lua_tonumber(L,-1);
+        switch(type) {
+        case MP_ARRAY_F64:
+            d = n;
+            memcpy(&v,&d,8);
+            mp_store64(p,v);
+            break;
+        case MP_ARRAY_F32:
+            f = (float)n;
+            memcpy(&w,&f,4);
+            mp_store32(p,w);
+            break;
+        case MP_ARRAY_I32:
+            if (floor(n) != n || n < -2147483648.0 || n > 2147483647.0)
+                return luaL_error(L,"array element %d out of range",i);
+            mp_store32(p,(uint32_t)(int32_t)n);
+            break;
+        default:
+#if LUA_VERSION_NUM >= 503
+            if (lua_isinteger(L,-1)) {
+                mp_store64(p,(uint64_t)lua_tointeger(L,-1));
+                break;
+            }
+#endif
+            if (floor(n) != n ||
+                n < -9223372036854775808.0 || n >= 9223372036854775808.0)
+                return luaL_error(L,"array element %d out of range",i);
+            mp_store64(p,(uint64_t)(int64_t)n);
+            break;
+        }
+        lua_pop(L,1);
+        p += mp_array_size[type];
+    }
+    return 1;
+}
+
+/* array[i] -- Elements are at integer keys, methods at string keys. */
+static int mp_array_index(lua_State *L) {
+    mp_array *a = luaL_checkudata(L,1,LUACMSGPACK_ARRAY_MT);
+    lua_Number n;
+
+    if (lua_type(L,2) == LUA_TNUMBER) {
+        n = lua_tonumber(L,2);
+        if (n >= 1 && n <= (lua_Number)a->len && floor(n) == n) {
+            mp_array_get(L,a,(size_t)n-1);
+            return 1;
+        }
+        return 0;
+    }
+    lua_pushvalue(L,2);
+    lua_rawget(L,lua_upvalueindex(1));
+    return 1;
+}
+
+static int mp_array_len(lua_State *L) {
+    mp_array *a = luaL_checkudata(L,1,LUACMSGPACK_ARRAY_MT);
+
+    lua_pushinteger(L,(lua_Integer)a->len);
+    return 1;
+}
+
+/* array:type() -- The type of the elements. */
+static int mp_array_type(lua_State *L) {
+    mp_array *a = luaL_checkudata(L,1,LUACMSGPACK_ARRAY_MT);
+
+    lua_pushstring(L,mp_array_types[a->type]);
+    return 1;
+}
+
+/* array:totable() -- A table with all the elements. */
+static int mp_array_totable(lua_State *L) {
+    mp_array *a = luaL_checkudata(L,1,LUACMSGPACK_ARRAY_MT);
+    size_t j;
+
+    lua_createtable(L,a->len > INT_MAX ? INT_MAX : (int)a->len,0);
+    for (j = 0; j < a->len; j++) {
+        mp_array_get(L,a,j);
+        lua_rawseti(L,-2,(int)j+1);
+    }
+    return 1;
+}
+
+static int mp_array_gc(lua_State *L) {
+    mp_array *a = luaL_checkudata(L,1,LUACMSGPACK_ARRAY_MT);
+
+    luaL_unref(L,LUA_REGISTRYINDEX,a->ref);
+    a->ref = LUA_NOREF;
+    return 0;
+}
+
+/* ------------------------------- String slices -------------------------------
+ * Decoding a big string copies it into a new Lua string, that is also
+ * hashed. When the string is just going to be forwarded somewhere else
+ * this is wasted work, so unpack() can return strings longer than a
+ * threshold as slices instead: userdata pointing into the input, that is
+ * anchored with a registry reference like views do. Slices are accepted
+ * in place of strings by the encoder, unpack() and raw(). */
+
+#define LUACMSGPACK_SLICE_MT "cmsgpack.slice"
+
+typedef struct mp_slice {
+    const char *p;
+    size_t len;
+    int ref;            /* Registry reference anchoring 'p'. */
+} mp_slice;
+
+/* Push a slice of the 'len' bytes at 'p', that belong to the string (or
+ * slice) at 'src'. */
+static void mp_slice_push(lua_State *L, const char *p, size_t len, int src) {
+    mp_slice *sl = lua_newuserdata(L,sizeof(*sl));
+
+    sl->p = p;
+    sl->len = len;
+    sl->ref = LUA_NOREF;
+    luaL_getmetatable(L,LUACMSGPACK_SLICE_MT);
+    lua_setmetatable(L,-2);
+    lua_pushvalue(L,src);
+    sl->ref = luaL_ref(L,LUA_REGISTRYINDEX);
+}
+
+/* Return the slice at 'idx', or NULL if it is not a slice. */
+static mp_slice *mp_toslice(lua_State *L, int idx) {
+    mp_slice *sl = lua_touserdata(L,idx);
+
+    if (sl == NULL || !lua_getmetatable(L,idx)) return NULL;
+    luaL_getmetatable(L,LUACMSGPACK_SLICE_MT);
+    if (!lua_rawequal(L,-1,-2)) sl = NULL;
+    lua_pop(L,2);
+    return sl;
+}
+
+/* Like lua_tolstring(), but slices are accepted too. */
+static const char *mp_tobytes(lua_State *L, int idx, size_t *len) {
+    mp_slice *sl;
+
+    if (lua_type(L,idx) == LUA_TUSERDATA && (sl = mp_toslice(L,idx))) {
+        *len = sl->len;
+        return sl->p;
+    }
+    if (!lua_isstring(L,idx)) return NULL;
+    return lua_tolstring(L,idx,len);
+}
+
+/* Like luaL_checklstring(), but slices are accepted too. */
+static const char *mp_checkbytes(lua_State *L, int idx, size_t *len) {
+    const char *s = mp_tobytes(L,idx,len);
+
+    return s ? s : luaL_checklstring(L,idx,len);
+}
+
+/* slice:len() / #slice */
+static int mp_slice_len(lua_State *L) {
+    mp_slice *sl = luaL_checkudata(L,1,LUACMSGPACK_SLICE_MT);
+
+    lua_pushinteger(L,(lua_Integer)sl->len);
+    return 1;
+}
+
+/* slice:sub(i [, j]) -- A slice of the bytes from 'i' to 'j', with the
+ * same meaning of string.sub(). */
+static int mp_slice_sub(lua_State *L) {
+    mp_slice *sl = luaL_checkudata(L,1,LUACMSGPACK_SLICE_MT);
+    lua_Integer len = (lua_Integer)sl->len;
+    lua_Integer i = luaL_checkinteger(L,2), j = luaL_optinteger(L,3,-1);
+
+    if (i < 0) i = i < -len ? 1 : len+i+1;
+    else if (i == 0) i = 1;
+    if (j < 0) j = j < -len ? 0 : len+j+1;
+    else if (j > len) j = len;
+    if (i > j) i = j+1;
+    mp_slice_push(L,sl->p+i-1,(size_t)(j-i+1),1);
+    return 1;
+}
+
+/* slice:tostring() / tostring(slice) -- Copy the bytes into a string. */
+static int mp_slice_tostring(lua_State *L) {
+    mp_slice *sl = luaL_checkudata(L,1,LUACMSGPACK_SLICE_MT);
+
+    lua_pushlstring(L,sl->p,sl->len);
+    return 1;
+}
+
+static int mp_slice_gc(lua_State *L) {
+    mp_slice *sl = luaL_checkudata(L,1,LUACMSGPACK_SLICE_MT);
+
+    luaL_unref(L,LUA_REGISTRYINDEX,sl->ref);
+    sl->ref = LUA_NOREF;
+    return 0;
+}
+
+/* ------------------------------- Ext values ----------------------------------
+ * Ext types other than the ones known by this library are decoded as ext
+ * values, userdata holding the type and the payload that are encoded back
+ * exactly the same. cmsgpack.ext(type, data) creates them, so that any
+ * ext can be sent, and cmsgpack.timestamp(sec [, nsec]) creates values of
+ * the timestamp type defined by the spec, that is decoded as a number. */
+
+#define LUACMSGPACK_EXT_MT "cmsgpack.ext"
+
+typedef struct mp_ext {
+    int type;
+    size_t len;
+    unsigned char data[1];
+} mp_ext;
+
+/* Push an ext value with a copy of the 'len' bytes at 'p'. */
+static void mp_ext_push(lua_State *L, int type, const unsigned char *p,
+                        size_t len)
+{
+    mp_ext *e = lua_newuserdata(L,sizeof(*e)+len);
+
+    e->type = type;
+    e->len = len;
+    memcpy(e->data,p,len);
+    luaL_getmetatable(L,LUACMSGPACK_EXT_MT);
+    lua_setmetatable(L,-2);
+}
+
+static void mp_ext_encode(mp_buf *buf, const mp_ext *e) {
+    unsigned char hdr[6];
+
+    mp_buf_append(buf,hdr,mp_ext_header(hdr,e->len,e->type));
+    mp_buf_append(buf,e->data,e->len);
+    mp_stats_type(buf,hdr[0]);
+}
+
+/* cmsgpack.ext(type, data) -- Create an ext value, 'type' must be in the
+ * range -128..127. */
+static int mp_ext_new(lua_State *L) {
+    lua_Integer type = luaL_checkinteger(L,1);
+    size_t len;
+    const char *data = luaL_checklstring(L,2,&len);
+
+    luaL_argcheck(L,type >= -128 && type <= 127,1,"ext type out of range");
+    mp_ext_push(L,(int)type,(const unsigned char*)data,len);
+    return 1;
+}
+
+/* cmsgpack.timestamp(sec [, nsec]) -- Create a timestamp ext value using
+ * the smallest of the three encodings of the spec. Without 'nsec' the
+ * fractional part of 'sec' is used. */
+static int mp_timestamp_new(lua_State *L) {
+    lua_Number n = luaL_checknumber(L,1), f = floor(n);
+    unsigned char p[12];
+    int64_t sec;
+    lua_Integer nsec;
+    size_t len;
+
+    luaL_argcheck(L,f >= -9223372036854775808.0 && f < 9223372036854775808.0,
+                  1,"timestamp out of range");
+    sec = (int64_t)f;
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L,1)) sec = lua_tointeger(L,1);
+#endif
+    if (lua_isnoneornil(L,2)) {
+        nsec = (lua_Integer)floor((n-f)*1e9+0.5);
+        if (nsec > 999999999) nsec = 999999999;
+    } else {
+        luaL_argcheck(L,f == n,1,"seconds must be integral with nsec");
+        nsec = luaL_checkinteger(L,2);
+        luaL_argcheck(L,nsec >= 0 && nsec <= 999999999,2,
+                      "nanoseconds out of range");
+    }
+    if (sec >= 0 && (sec >> 34) == 0) {
+        if (nsec == 0 && sec <= 0xffffffffLL) {
+            mp_store32(p,(uint32_t)sec);
+            len = 4;
+        } else {
+            mp_store64(p,((uint64_t)nsec << 34) | (uint64_t)sec);
+            len = 8;
+        }
+    } else {
+        mp_store32(p,(uint32_t)nsec);
+        mp_store64(p+4,(uint64_t)sec);
+        len = 12;
+    }
+    mp_ext_push(L,LUACMSGPACK_TIMESTAMP_EXT,p,len);
+    return 1;
+}
+
+/* ext.type, ext.data -- The type and the payload. */
+static int mp_ext_index(lua_State *L) {
+    mp_ext *e = luaL_checkudata(L,1,LUACMSGPACK_EXT_MT);
+    const char *k = lua_tostring(L,2);
+
+    if (k && strcmp(k,"type") == 0)
+        lua_pushinteger(L,e->type);
+    else if (k && strcmp(k,"data") == 0)
+        lua_pushlstring(L,(char*)e->data,e->len);
+    else
+        lua_pushnil(L);
+    return 1;
+}
+
+/* ----------------------------- Ext type registry -----------------------------
+ * Userdata of other modules can be encoded as ext values registering an
+ * encoder for their metatable, and ext values can be decoded by a decoder
+ * registered for their type:
+ *
+ *   cmsgpack.register_ext(type, mt, encoder, decoder)
+ *
+ * The Lua encoder gets the userdata and returns the payload as a string,
+ * the Lua decoder gets the payload and the type and returns the value.
+ * C modules can register C hooks instead with cmsgpack_register_ext(),
+ * declared in lua_cmsgpack.h and also published in the registry: the
+ * encoder just returns a pointer to the payload, that is copied
+ * straight into the buffer, and the decoder gets a pointer into the input,
+ * so no intermediate Lua string is created.
+ *
+ * Hooks are kept in a table in the registry, mapping both the metatable
+ * and the type to a mp_ext_hook, so they are shared by all the codecs. */
+
+#define LUACMSGPACK_EXTS    "cmsgpack.exts"
+#define LUACMSGPACK_HOOK_MT "cmsgpack.exthook"
+
+typedef struct mp_ext_hook {
+    int type;
+    cmsgpack_ext_encoder cenc;
+    cmsgpack_ext_decoder cdec;
+    int enc, dec;       /* Registry references of the Lua hooks. */
+} mp_ext_hook;
+
+/* Replace the encoder of the metatable at 'mt' (unless 'mt' is 0) and the
+ * decoder of 'type'. The Lua hooks are at the stack indexes 'enc' and
+ * 'dec', if not 0, otherwise the C hooks are used. If there is no hook the
+ * registration is removed. */
+static void mp_ext_register(lua_State *L, int type, int mt, int enc, int dec,
+                            cmsgpack_ext_encoder cenc,
+                            cmsgpack_ext_decoder cdec)
+{
+    mp_ext_hook *h;
+    int has_enc, has_dec;
+
+    if (mt < 0 && mt > LUA_REGISTRYINDEX) mt = lua_gettop(L)+mt+1;
+    lua_getfield(L,LUA_REGISTRYINDEX,LUACMSGPACK_EXTS);
+    if (lua_isnil(L,-1)) {
+        lua_pop(L,1);
+        lua_newtable(L);
+        lua_pushvalue(L,-1);
+        lua_setfield(L,LUA_REGISTRYINDEX,LUACMSGPACK_EXTS);
+    }
+    h = lua_newuserdata(L,sizeof(*h));
+    h->type = type;
+    h->cenc = cenc;
+    h->cdec = cdec;
+    h->enc = h->dec = LUA_NOREF;
+    luaL_getmetatable(L,LUACMSGPACK_HOOK_MT);
+    lua_setmetatable(L,-2);
+    if (enc) {
+        lua_pushvalue(L,enc);
+        h->enc = luaL_ref(L,LUA_REGISTRYINDEX);
+    }
+    if (dec) {
+        lua_pushvalue(L,dec);
+        h->dec = luaL_ref(L,LUA_REGISTRYINDEX);
+    }
+    has_enc = h->cenc || h->enc != LUA_NOREF;
+    has_dec = h->cdec || h->dec != LUA_NOREF;
+    if (mt) {
+        lua_pushvalue(L,mt);
+        if (has_enc) lua_pushvalue(L,-2); else lua_pushnil(L);
+        lua_rawset(L,-4);
+    }
+    lua_pushinteger(L,type);
+    if (has_dec) lua_pushvalue(L,-2); else lua_pushnil(L);
+    lua_rawset(L,-4);
+    lua_pop(L,2);
+}
+
+/* Register C hooks for the ext 'type' and the metatable at the stack
+ * index 'mt' (0 to register just a decoder). Either hook can be NULL. */
+LUALIB_API void cmsgpack_register_ext(lua_State *L, int type, int mt,
+                                      cmsgpack_ext_encoder enc,
+                                      cmsgpack_ext_decoder dec)
+{
+    mp_ext_register(L,type,mt,0,0,enc,dec);
+}
+
+/* The C API, published in the registry under CMSGPACK_API. */
+static cmsgpack_api mp_api = {CMSGPACK_API_VERSION, cmsgpack_register_ext};
+
+/* cmsgpack.register_ext(type, mt, encoder, decoder) -- Any argument but
+ * the type can be nil. Types 126 and 127 are reserved. */
+static int mp_register_ext(lua_State *L) {
+    lua_Integer type = luaL_checkinteger(L,1);
+
+    lua_settop(L,4);
+    luaL_argcheck(L,type >= -128 && type <= 127 &&
+                  type != LUACMSGPACK_REF_EXT && type != LUACMSGPACK_ARRAY_EXT,
+                  1,"invalid ext type");
+    if (!lua_isnil(L,2)) luaL_checktype(L,2,LUA_TTABLE);
+    if (!lua_isnil(L,3)) luaL_checktype(L,3,LUA_TFUNCTION);
+    if (!lua_isnil(L,4)) luaL_checktype(L,4,LUA_TFUNCTION);
+    mp_ext_register(L,(int)type,lua_isnil(L,2) ? 0 : 2,
+                    lua_isnil(L,3) ? 0 : 3,lua_isnil(L,4) ? 0 : 4,NULL,NULL);
+    return 0;
+}
+
+/* Set the MP_BUF_ERROR_EXT error, with the message at the top of the
+ * stack, that is popped. Only the first error is kept. */
+static void mp_ext_hook_error(lua_State *L, mp_buf *buf) {
+    if (buf->err == MP_BUF_ERROR_NONE) {
+        buf->err = MP_BUF_ERROR_EXT;
+        buf->errmsg = luaL_ref(L,LUA_REGISTRYINDEX);
+    } else {
+        lua_pop(L,1);
+    }
+}
+
+/* Encode the userdata just below the top of the stack, with its metatable
+ * at the top, if there is an encoder for the metatable. Return 0 if there
+ * is none. */
+static int mp_ext_hook_encode(lua_State *L, mp_buf *buf) {
+    mp_ext_hook *h;
+    unsigned char hdr[6];
+    const void *p;
+    size_t len;
+
+    lua_getfield(L,LUA_REGISTRYINDEX,LUACMSGPACK_EXTS);
+    if (lua_isnil(L,-1)) {
+        lua_pop(L,1);
+        return 0;
+    }
+    lua_pushvalue(L,-2);
+    lua_rawget(L,-2);
+    h = lua_touserdata(L,-1);
+    if (h == NULL) {
+        lua_pop(L,2);
+        return 0;
+    }
+    if (h->cenc) {
+        if (h->cenc(L,lua_gettop(L)-3,&p,&len)) {
+            mp_buf_append(buf,hdr,mp_ext_header(hdr,len,h->type));
+            mp_buf_append(buf,p,len);
+            mp_stats_type(buf,hdr[0]);
+        } else {
+            lua_pushstring(L,"Ext encoder failed.");
+            mp_ext_hook_error(L,buf);
+        }
+    } else {
+        lua_rawgeti(L,LUA_REGISTRYINDEX,h->enc);
+        lua_pushvalue(L,-5);
+        if (lua_pcall(L,1,1,0) != 0) {
+            mp_ext_hook_error(L,buf);
+        } else if (lua_type(L,-1) != LUA_TSTRING) {
+            lua_pop(L,1);
+            lua_pushstring(L,"Ext encoder must return a string.");
+            mp_ext_hook_error(L,buf);
+        } else {
+            p = lua_tolstring(L,-1,&len);
+            mp_buf_append(buf,hdr,mp_ext_header(hdr,len,h->type));
+            mp_buf_append(buf,p,len);
+            mp_stats_type(buf,hdr[0]);
+            lua_pop(L,1);
+        }
+    }
+    lua_pop(L,2);
+    return 1;
+}
+
+/* Decode the ext payload of 'type', 'len' bytes at 'p', if there is a
+ * decoder for the type. Return 0 if there is none. */
+static int mp_ext_hook_decode(lua_State *L, mp_cur *c, int type,
+                              const unsigned char *p, size_t len)
+{
+    mp_ext_hook *h;
+
+    luaL_checkstack(L,4,"too many nested ext values");
+    lua_getfield(L,LUA_REGISTRYINDEX,LUACMSGPACK_EXTS);
+    if (lua_isnil(L,-1)) {
+        lua_pop(L,1);
+        return 0;
+    }
+    lua_rawgeti(L,-1,type);
+    h = lua_touserdata(L,-1);
+    if (h == NULL) {
+        lua_pop(L,2);
+        return 0;
+    }
+    if (h->cdec) {
+        if (!h->cdec(L,(const char*)p,len)) {
+            c->err = MP_CUR_ERROR_BADFMT;
+            lua_pop(L,2);
+            return 1;
+        }
+    } else {
+        lua_rawgeti(L,LUA_REGISTRYINDEX,h->dec);
+        lua_pushlstring(L,(const char*)p,len);
+        lua_pushinteger(L,type);
+        lua_call(L,2,1);
+    }
+    lua_replace(L,-3);
+    lua_pop(L,1);
+    return 1;
+}
+
+static int mp_ext_hook_gc(lua_State *L) {
+    mp_ext_hook *h = luaL_checkudata(L,1,LUACMSGPACK_HOOK_MT);
+
+    luaL_unref(L,LUA_REGISTRYINDEX,h->enc);
+    luaL_unref(L,LUA_REGISTRYINDEX,h->dec);
+    h->enc = h->dec = LUA_NOREF;
+    return 0;
+}
+
+/* ---------------------------- Pre-packed fragments ----------------------------
+ * Objects that are sent again and again inside different messages don't
+ * need to be encoded every time:
+ *
+ * cmsgpack.raw(s) wraps the encoding of an object into a userdata that the
+ * encoder copies verbatim into its output, cmsgpack.prepack(obj) does the
+ * same with the encoding of 'obj'. Views are copied verbatim as well.
+ *
+ * cmsgpack.freeze(t) encodes the table 't' once and stores the result in a
+ * weak keyed memo table of the codec, that the encoder checks for every
+ * table once something was frozen. */
+
+#define LUACMSGPACK_RAW_MT "cmsgpack.raw"
+
+typedef struct mp_raw {
+    size_t len;
+    unsigned char data[1];
+} mp_raw;
+
+static void mp_raw_push(lua_State *L, const unsigned char *s, size_t len) {
+    mp_raw *r = lua_newuserdata(L,sizeof(*r)+len);
+
+    r->len = len;
+    memcpy(r->data,s,len);
+    luaL_getmetatable(L,LUACMSGPACK_RAW_MT);
+    lua_setmetatable(L,-2);
+}
+
+/* Encode the userdata at the top of the stack: raw fragments and views are
+ * copied, slices are encoded as strings, typed arrays, ext values and
+ * userdata with a registered encoder are encoded as ext, every other
+ * userdata is encoded as nil. */
+static void mp_encode_lua_userdata(lua_State *L, mp_buf *buf) {
+    void *p = lua_touserdata(L,-1);
+
+    if (lua_getmetatable(L,-1)) {
+        luaL_getmetatable(L,LUACMSGPACK_RAW_MT);
+        if (lua_rawequal(L,-1,-2)) {
+            mp_buf_append(buf,((mp_raw*)p)->data,((mp_raw*)p)->len);
+            mp_encode_ref_skip(buf,((mp_raw*)p)->data,((mp_raw*)p)->len,0);
+            mp_stats_elements(buf,((mp_raw*)p)->data,((mp_raw*)p)->len,1);
+            lua_pop(L,2);
+            return;
+        }
+        lua_pop(L,1);
+        luaL_getmetatable(L,LUACMSGPACK_VIEW_MT);
+        if (lua_rawequal(L,-1,-2)) {
+            mp_buf_append(buf,((mp_view*)p)->p,((mp_view*)p)->len);
+            mp_encode_ref_skip(buf,((mp_view*)p)->p,((mp_view*)p)->len,0);
+            mp_stats_elements(buf,((mp_view*)p)->p,((mp_view*)p)->len,1);
+            lua_pop(L,2);
+            return;
+        }
+        lua_pop(L,1);
+        luaL_getmetatable(L,LUACMSGPACK_ARRAY_MT);
+        if (lua_rawequal(L,-1,-2)) {
+            mp_array_encode(buf,p);
+            lua_pop(L,2);
+            return;
+        }
+        lua_pop(L,1);
+        luaL_getmetatable(L,LUACMSGPACK_EXT_MT);
+        if (lua_rawequal(L,-1,-2)) {
+            mp_ext_encode(buf,p);
+            lua_pop(L,2);
+            return;
+        }
+        lua_pop(L,1);
+        luaL_getmetatable(L,LUACMSGPACK_SLICE_MT);
+        if (lua_rawequal(L,-1,-2)) {
+            mp_encode_bytes(buf,(const unsigned char*)((mp_slice*)p)->p,
+                            ((mp_slice*)p)->len);
+            lua_pop(L,2);
+            return;
+        }
+        lua_pop(L,1);
+        if (mp_ext_hook_encode(L,buf)) {
+            lua_pop(L,1);
+            return;
+        }
+        lua_pop(L,1);
+    }
+    mp_encode_lua_null(L,buf);
+}
+
+/* If the table at the top of the stack is frozen copy its encoding and
+ * return 1, otherwise return 0. */
+static int mp_encode_lua_frozen(lua_State *L, mp_buf *buf) {
+    const char *s;
+    size_t len;
+
+    lua_rawgeti(L,LUA_REGISTRYINDEX,buf->memo);
+    lua_pushvalue(L,-2);
+    lua_rawget(L,-2);
+    s = lua_tolstring(L,-1,&len);
+    if (s) {
+        mp_buf_append(buf,(const unsigned char*)s,len);
+        mp_encode_ref_skip(buf,(const unsigned char*)s,len,1);
+        mp_stats_elements(buf,(const unsigned char*)s,len,1);
+    }
+    lua_pop(L,2);
+    return s != NULL;
+}
+
+/* cmsgpack.raw(s) / codec:raw(s) -- 's' must be exactly one object. */
+static int mp_raw_new(lua_State *L) {
+    int arg = mp_codec_firstarg(L);
+    const unsigned char *s;
+    size_t len, olen;
+
+    s = (const unsigned char*) mp_checkbytes(L,arg,&len);
+    mp_scan_check(L,mp_skip_object(s,len,&olen));
+    if (olen != len) {
+        lua_pushstring(L,"Extra bytes in input.");
+        lua_error(L);
+    }
+    mp_raw_push(L,s,len);
+    return 1;
+}
+
+/* Protected part of mp_codec_encode(), see mp_codec_pcall(). */
+static int mp_codec_encode_value(lua_State *L) {
+    mp_buf *buf = &((mp_codec*)lua_touserdata(L,1))->buf;
+
+    lua_pushvalue(L,2);
+    mp_encode_lua_type(L,buf,0);
+    if (buf->err) return 0;
+    if (lua_toboolean(L,3))
+        mp_raw_push(L,buf->b,buf->len);
+    else
+        lua_pushlstring(L,(char*)buf->b,buf->len);
+    return 1;
+}
+
+/* Encode the value at 'idx' with the codec, pushing the encoding as a raw
+ * fragment if 'raw' is true, or as a string. The codec must be released by
+ * the caller. Fragments can be copied anywhere, so they can't contain
+ * references: "dedupe" codecs just check for cycles. */
+static mp_codec *mp_codec_encode(lua_State *L, int idx, int raw) {
+    mp_codec *codec = mp_codec_acquire(L,mp_codec_get(L));
+
+    if (codec->buf.refs.mode == MP_REFS_DEDUPE)
+        codec->buf.refs.mode = MP_REFS_STRICT;
+    lua_pushvalue(L,idx);
+    lua_pushboolean(L,raw);
+    mp_codec_pcall(L,codec,mp_codec_encode_value,2);
+    mp_codec_check(L,codec);
+    return codec;
+}
+
+/* cmsgpack.prepack(obj) / codec:prepack(obj) */
+static int mp_prepack(lua_State *L) {
+    int arg = mp_codec_firstarg(L);
+    mp_codec *codec;
+
+    luaL_checkany(L,arg);
+    codec = mp_codec_encode(L,arg,1);
+    mp_codec_release(codec);
+    return 1;
+}
+
+/* cmsgpack.freeze(t) / codec:freeze(t) -- The table must not be modified
+ * afterwards, it is returned to allow chaining. */
+static int mp_freeze(lua_State *L) {
+    mp_codec *codec = mp_codec_get(L);
+    int arg = mp_codec_firstarg(L), memo;
+
+    luaL_checktype(L,arg,LUA_TTABLE);
+    lua_settop(L,arg);
+    if (codec->memo == LUA_NOREF) {
+        lua_newtable(L);
+        lua_createtable(L,0,1);
+        lua_pushliteral(L,"k");
+        lua_setfield(L,-2,"__mode");
+        lua_setmetatable(L,-2);
+        codec->memo = luaL_ref(L,LUA_REGISTRYINDEX);
+    }
+    memo = codec->memo;
+    codec = mp_codec_encode(L,arg,0);
+    mp_codec_release(codec);
+    lua_rawgeti(L,LUA_REGISTRYINDEX,memo);
+    lua_pushvalue(L,arg);
+    lua_pushvalue(L,-3);
+    lua_rawset(L,-3);
+    lua_settop(L,arg);
+    return 1;
+}
+
+/* ---------------------------- Path extraction -------------------------------
+ * cmsgpack.get(s, key1, key2, ...) returns the same value as
+ * unpack(s)[key1][key2]..., but only the target value is decoded: the
+ * sibling elements met along the path are skipped looking at headers
+ * alone, and only the bytes actually walked are checked. */
+
+/* cmsgpack.get(s, ...) / codec:get(s, ...) -- Return the value at the
+ * given path, or nothing if there is no such value. */
+static int mp_get(lua_State *L) {
+    mp_codec *codec = mp_codec_get(L);
+    int arg = mp_codec_firstarg(L), top = lua_gettop(L), k, isarray;
+    const unsigned char *p;
+    size_t left, hlen, klen, vlen;
+    uint64_t count, j;
+    mp_opts opts;
+    mp_cur c;
+
+    p = (const unsigned char*) luaL_checklstring(L,arg,&left);
+    for (k = arg+1; k <= top; k++) {
+        mp_scan_check(L,mp_scan_element(p,left,&hlen,&count));
+        if (!mp_is_container(p[0])) return 0;
+        isarray = (p[0] & 0xf0) == 0x90 || p[0] == 0xdc || p[0] == 0xdd;
+        p += hlen;
+        left -= hlen;
+        if (isarray) {
+            /* Array: skip the elements before the one at the index. */
+            lua_Number n = lua_tonumber(L,k);
+
+            if (lua_type(L,k) != LUA_TNUMBER || n < 1 || n > (lua_Number)count
+                || n != (lua_Number)(uint64_t)n) return 0;
+            for (j = 1; j < (uint64_t)n; j++) {
+                mp_scan_check(L,mp_skip_object(p,left,&vlen));
+                p += vlen;
+                left -= vlen;
+            }
+            continue;
+        }
+        /* Map: look for the key, skipping the values of the others. */
+        for (j = 0; j < count; j += 2) {
+            mp_scan_check(L,mp_skip_object(p,left,&klen));
+            if (mp_key_equals(L,&codec->opts,k,p,klen)) break;
+            p += klen;
+            left -= klen;
+            mp_scan_check(L,mp_skip_object(p,left,&vlen));
+            p += vlen;
+            left -= vlen;
+        }
+        if (j == count) return 0;
+        p += klen;
+        left -= klen;
+    }
+    /* References ids count from the start of the whole object, those in
+     * a nested value can't be resolved. */
+    opts = codec->opts;
+    if (top > arg) opts.refs = MP_REFS_OFF;
+    mp_cur_init(&c,p,left);
+    c.opts = &opts;
+    c.src = arg;
+    mp_decode_to_lua_type(L,&c);
+    mp_cur_check(L,&c);
+    return 1;
+}
+
+/* ------------------------- Validation and scanning ---------------------------
+ * Check input before paying for unpack(): both functions walk the
+ * concatenated objects in the string with mp_scan(), so no Lua value is
+ * created for the elements. */
+
+/* cmsgpack.validate(s) -- Return true and the number of top level objects
+ * if 's' is well formed, otherwise false, the error message and the 1-based
+ * position of the offending element. */
+static int mp_validate(lua_State *L) {
+    const unsigned char *s;
+    size_t len;
+    mp_scan_stats st;
+    int err;
+
+    s = (const unsigned char*) luaL_checklstring(L,1,&len);
+    err = mp_scan(s,len,&st);
+    if (err != MP_CUR_ERROR_NONE) {
+        lua_pushboolean(L,0);
+        lua_pushstring(L,mp_scan_errstr(err));
+        lua_pushinteger(L,(lua_Integer)(st.pos+1));
+        return 3;
+    }
+    lua_pushboolean(L,1);
+    lua_pushinteger(L,(lua_Integer)st.objects);
+    return 2;
+}
+
+/* cmsgpack.scan(s) -- Return a table describing the objects in 's', with
+ * the fields objects, elements, depth, arrays, maps and string_bytes.
+ * Errors are raised like in unpack(). */
+static int mp_scan_lua(lua_State *L) {
+    const unsigned char *s;
+    size_t len;
+    mp_scan_stats st;
+
+    s = (const unsigned char*) luaL_checklstring(L,1,&len);
+    mp_scan_check(L,mp_scan(s,len,&st));
+    lua_createtable(L,0,6);
+    lua_pushinteger(L,(lua_Integer)st.objects);
+    lua_setfield(L,-2,"objects");
+    lua_pushinteger(L,(lua_Integer)st.elements);
+    lua_setfield(L,-2,"elements");
+    lua_pushinteger(L,(lua_Integer)st.depth);
+    lua_setfield(L,-2,"depth");
+    lua_pushinteger(L,(lua_Integer)st.arrays);
+    lua_setfield(L,-2,"arrays");
+    lua_pushinteger(L,(lua_Integer)st.maps);
+    lua_setfield(L,-2,"maps");
+    lua_pushinteger(L,(lua_Integer)st.string_bytes);
+    lua_setfield(L,-2,"string_bytes");
+    return 1;
+}
+
+/* ------------------------------ Codec bindings ------------------------------ */
+
+/* Helpers to read a field of the options table at 'idx'. */
+static lua_Integer mp_opt_integer(lua_State *L, int idx, const char *name,
+                                  lua_Integer def)
+{
+    lua_Integer v = def;
+
+    lua_getfield(L,idx,name);
+    if (!lua_isnil(L,-1)) {
+        if (!lua_isnumber(L,-1))
+            luaL_error(L,"option '%s' must be a number",name);
+        v = lua_tointeger(L,-1);
+        if (v < 0) luaL_error(L,"option '%s' must be >= 0",name);
+    }
+    lua_pop(L,1);
+    return v;
+}
+
+static int mp_opt_option(lua_State *L, int idx, const char *name,
+                         const char *const lst[], int def)
+{
+    const char *v;
+    int j;
+
+    lua_getfield(L,idx,name);
+    if (lua_isnil(L,-1)) {
+        lua_pop(L,1);
+        return def;
+    }
+    v = lua_tostring(L,-1);
+    for (j = 0; v && lst[j]; j++) {
+        if (strcmp(v,lst[j]) == 0) {
+            lua_pop(L,1);
+            return j;
+        }
+    }
+    return luaL_error(L,"invalid value for option '%s'",name);
+}
+
+/* cmsgpack.new([opts]) -- Create a codec. Accepted options are:
+ *
+ * 'buffer_size', the initial capacity of the encoding buffer.
+ * 'shrink_after', how many calls to wait before trying to give unused
+ *                 buffer memory back (0 disables shrinking).
+ * 'uint64', what to do with uint 64 values that don't fit a Lua integer:
+ *           "float" (the default), "wrap" or "error".
+ * 'max_depth', the max nesting of tables, both encoding and decoding.
+ * 'refs', how tables met more than once are encoded: "off" (the default),
+ *         "strict" (cycles are an error) or "dedupe" (as references).
+ * 'strings', the type Lua strings are encoded as: "str" (the default) or
+ *            "bin". Both are decoded as strings. */
+static int mp_new(lua_State *L) {
+    static const char *const uint64_modes[] = {"float", "wrap", "error", NULL};
+    static const char *const refs_modes[] = {"off", "strict", "dedupe", NULL};
+    static const char *const strings_modes[] = {"str", "bin", NULL};
+    mp_codec *codec;
+    lua_Integer depth;
+
+    lua_settop(L,1);
+    codec = mp_codec_new(L,NULL);
+    if (!lua_isnil(L,1)) {
+        luaL_checktype(L,1,LUA_TTABLE);
+        codec->buffer_size =
+            mp_opt_integer(L,1,"buffer_size",codec->buffer_size);
+        codec->shrink_after =
+            mp_opt_integer(L,1,"shrink_after",codec->shrink_after);
+        codec->opts.uint64 =
+            mp_opt_option(L,1,"uint64",uint64_modes,codec->opts.uint64);
+        depth = mp_opt_integer(L,1,"max_depth",codec->opts.max_depth);
+        codec->opts.max_depth = depth > INT_MAX ? INT_MAX : (int)depth;
+        codec->opts.refs =
+            mp_opt_option(L,1,"refs",refs_modes,codec->opts.refs);
+        codec->opts.strings =
+            mp_opt_option(L,1,"strings",strings_modes,codec->opts.strings);
+    }
+    mp_codec_reserve(codec);
+    return 1;
+}
+
+static int mp_codec_gc(lua_State *L) {
+    mp_codec *codec = luaL_checkudata(L,1,LUACMSGPACK_CODEC_MT);
+
+    mp_buf_free(&codec->buf);
+    luaL_unref(L,LUA_REGISTRYINDEX,codec->memo);
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------- */
+
+#if LUA_VERSION_NUM < 502
+/* Lua 5.1 lacks luaL_setfuncs(), that is needed to share upvalues. */
+static void luaL_setfuncs(lua_State *L, const luaL_reg *l, int nup) {
+    int i;
+
+    for (; l->name != NULL; l++) {
+        for (i = 0; i < nup; i++) lua_pushvalue(L,-nup);
+        lua_pushcclosure(L,l->func,nup);
+        lua_setfield(L,-(nup+2),l->name);
+    }
+    lua_pop(L,nup);
+}
+
+static const struct luaL_reg thislib[] = {
+#else
+static const struct luaL_Reg thislib[] = {
+#endif
+    {"pack", mp_pack},
+    {"unpack", mp_unpack},
+    {"unpack_one", mp_unpack_one},
+    {"unpack_limit", mp_unpack_limit},
+    {"unpack_into", mp_unpack_into},
+    {"new", mp_new},
+    {"unpacker", mp_unpacker_new},
+    {"packer", mp_packer_new},
+    {"encoder", mp_encoder_new},
+    {"decoder", mp_decoder_new},
+    {"view", mp_view_new},
+    {"get", mp_get},
+    {"compile", mp_compile},
+    {"raw", mp_raw_new},
+    {"prepack", mp_prepack},
+    {"freeze", mp_freeze},
+#ifdef LUACMSGPACK_STATS
+    {"stats", mp_stats_lua},
+    {"reset_stats", mp_reset_stats},
+#endif
+    {"validate", mp_validate},
+    {"scan", mp_scan_lua},
+    {"array", mp_array_new},
+    {"ext", mp_ext_new},
+    {"timestamp", mp_timestamp_new},
+    {"register_ext", mp_register_ext},
+    {NULL, NULL}
+};
+
+/* Methods of codec objects. The same C functions of the module are used,
+ * see mp_codec_get(). */
+#if LUA_VERSION_NUM < 502
+static const struct luaL_reg codec_methods[] = {
+#else
+static const struct luaL_Reg codec_methods[] = {
+#endif
+    {"pack", mp_pack},
+    {"unpack", mp_unpack},
+    {"unpack_one", mp_unpack_one},
+    {"unpack_limit", mp_unpack_limit},
+    {"unpack_into", mp_unpack_into},
+    {"unpacker", mp_unpacker_new},
+    {"packer", mp_packer_new},
+    {"encoder", mp_encoder_new},
+    {"decoder", mp_decoder_new},
+    {"view", mp_view_new},
+    {"get", mp_get},
+    {"compile", mp_compile},
+    {"raw", mp_raw_new},
+    {"prepack", mp_prepack},
+    {"freeze", mp_freeze},
+#ifdef LUACMSGPACK_STATS
+    {"stats", mp_stats_lua},
+    {"reset_stats", mp_reset_stats},
+#endif
+    {NULL, NULL}
+};
+
+#if LUA_VERSION_NUM < 502
+static const struct luaL_reg unpacker_methods[] = {
+#else
+static const struct luaL_Reg unpacker_methods[] = {
+#endif
+    {"feed", mp_unpacker_feed},
+    {"next", mp_unpacker_next},
+    {"buffered", mp_unpacker_buffered},
+    {"reset", mp_unpacker_reset},
+    {NULL, NULL}
+};
+
+#if LUA_VERSION_NUM < 502
+static const struct luaL_reg packer_methods[] = {
+#else
+static const struct luaL_Reg packer_methods[] = {
+#endif
+    {"pack", mp_packer_pack},
+    {"array_begin", mp_packer_array_begin},
+    {"map_begin", mp_packer_map_begin},
+    {"flush", mp_packer_flush_lua},
+    {"bytes", mp_packer_bytes},
+    {NULL, NULL}
+};
+
+#if LUA_VERSION_NUM < 502
+static const struct luaL_reg job_methods[] = {
+#else
+static const struct luaL_Reg job_methods[] = {
+#endif
+    {"step", mp_job_step_lua},
+    {"run", mp_job_run},
+    {NULL, NULL}
+};
+
+#if LUA_VERSION_NUM < 502
+static const struct luaL_reg view_metamethods[] = {
+#else
+static const struct luaL_Reg view_metamethods[] = {
+#endif
+    {"__index", mp_view_index},
+    {"__len", mp_view_len},
+    {"__pairs", mp_view_pairs},
+    {"__call", mp_view_call},
+    {"__gc", mp_view_gc},
+    {NULL, NULL}
+};
+
+#if LUA_VERSION_NUM < 502
+static const struct luaL_reg slice_methods[] = {
+#else
+static const struct luaL_Reg slice_methods[] = {
+#endif
+    {"len", mp_slice_len},
+    {"sub", mp_slice_sub},
+    {"tostring", mp_slice_tostring},
+    {NULL, NULL}
+};
+
+#if LUA_VERSION_NUM < 502
+static const struct luaL_reg array_methods[] = {
+#else
+static const struct luaL_Reg array_methods[] = {
+#endif
+    {"totable", mp_array_totable},
+    {"type", mp_array_type},
+    {NULL, NULL}
+};
+
+LUALIB_API int luaopen_cmsgpack_core (lua_State *L) {
+    /* Codec metatable, methods are reachable via __index. */
+    luaL_newmetatable(L,LUACMSGPACK_CODEC_MT);
+    lua_pushcfunction(L,mp_codec_gc);
+    lua_setfield(L,-2,"__gc");
+    lua_newtable(L);
+    luaL_setfuncs(L,codec_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,LUACMSGPACK_UNPACKER_MT);
+    lua_pushcfunction(L,mp_unpacker_gc);
+    lua_setfield(L,-2,"__gc");
+    lua_newtable(L);
+    luaL_setfuncs(L,unpacker_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,LUACMSGPACK_PACKER_MT);
+    lua_pushcfunction(L,mp_packer_gc);
+    lua_setfield(L,-2,"__gc");
+    lua_newtable(L);
+    luaL_setfuncs(L,packer_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,LUACMSGPACK_JOB_MT);
+    lua_pushcfunction(L,mp_job_gc);
+    lua_setfield(L,-2,"__gc");
+    lua_newtable(L);
+    luaL_setfuncs(L,job_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,LUACMSGPACK_RAW_MT);
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,LUACMSGPACK_TEMPLATE_MT);
+    lua_pushcfunction(L,mp_template_gc);
+    lua_setfield(L,-2,"__gc");
+    lua_pop(L,1);
+
+    /* Views have no methods, every key is looked up in the data. */
+    luaL_newmetatable(L,LUACMSGPACK_VIEW_MT);
+    luaL_setfuncs(L,view_metamethods,0);
+    lua_pop(L,1);
+
+    /* Typed arrays, __index finds the methods in its upvalue. */
+    luaL_newmetatable(L,LUACMSGPACK_ARRAY_MT);
+    lua_newtable(L);
+    luaL_setfuncs(L,array_methods,0);
+    lua_pushcclosure(L,mp_array_index,1);
+    lua_setfield(L,-2,"__index");
+    lua_pushcfunction(L,mp_array_len);
+    lua_setfield(L,-2,"__len");
+    lua_pushcfunction(L,mp_array_gc);
+    lua_setfield(L,-2,"__gc");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,LUACMSGPACK_EXT_MT);
+    lua_pushcfunction(L,mp_ext_index);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,LUACMSGPACK_SLICE_MT);
+    lua_newtable(L);
+    luaL_setfuncs(L,slice_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pushcfunction(L,mp_slice_len);
+    lua_setfield(L,-2,"__len");
+    lua_pushcfunction(L,mp_slice_tostring);
+    lua_setfield(L,-2,"__tostring");
+    lua_pushcfunction(L,mp_slice_gc);
+    lua_setfield(L,-2,"__gc");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,LUACMSGPACK_HOOK_MT);
+    lua_pushcfunction(L,mp_ext_hook_gc);
+    lua_setfield(L,-2,"__gc");
+    lua_pop(L,1);
+
+    lua_pushlightuserdata(L,&mp_api);
+    lua_setfield(L,LUA_REGISTRYINDEX,CMSGPACK_API);
+
+#if LUA_VERSION_NUM < 502
+    lua_pushlightuserdata(L,&mp_trampoline_key);
+    lua_pushcfunction(L,mp_trampoline);
+    lua_rawset(L,LUA_REGISTRYINDEX);
+#endif
+
+#if LUA_VERSION_NUM < 502
+    {
+        static const struct luaL_reg nofuncs[] = {{NULL, NULL}};
+        luaL_register(L, "cmsgpack", nofuncs);
+    }
+#else
+    lua_newtable(L);
 #endif
+    /* Every module function shares the default codec as upvalue. */
+    mp_codec_reserve(mp_codec_new(L,NULL));
+    luaL_setfuncs(L,thislib,1);
 
     lua_pushliteral(L, LUACMSGPACK_VERSION);
     lua_setfield(L, -2, "_VERSION");
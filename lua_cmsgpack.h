@@ -0,0 +1,58 @@
+/* lua_cmsgpack.h -- C API of lua-cmsgpack for other C modules.
+ *
+ * See the license at the end of lua_cmsgpack.c.
+ *
+ * C modules can register C hooks for their userdata, see the CUSTOM EXT
+ * TYPES section of README.md. Code linked with lua_cmsgpack.c can call
+ * cmsgpack_register_ext() directly. Since Lua loads C modules with their
+ * symbols private (RTLD_LOCAL), other modules should instead find the API
+ * in the registry once cmsgpack is loaded:
+ *
+ *   const cmsgpack_api *api;
+ *
+ *   lua_getfield(L,LUA_REGISTRYINDEX,CMSGPACK_API);
+ *   api = (const cmsgpack_api *)lua_touserdata(L,-1);
+ *   lua_pop(L,1);
+ *   if (api && api->version >= 1)
+ *       api->register_ext(L,type,mt,my_encoder,my_decoder);
+ */
+
+#ifndef LUA_CMSGPACK_H
+#define LUA_CMSGPACK_H
+
+#include <stddef.h>
+#include "lua.h"
+
+/* Registry field holding a light userdata that points to the cmsgpack_api
+ * of the loaded module. */
+#define CMSGPACK_API            "cmsgpack.api"
+#define CMSGPACK_API_VERSION    1
+
+/* C hooks. The encoder sets '*p' and '*len' to the payload of the userdata
+ * at 'idx', that must stay valid until the encoding ends, and returns 1,
+ * or 0 on failure. The decoder pushes the value decoded from the 'len'
+ * bytes at 'p' and returns 1, or returns 0 if the payload is not valid.
+ * They must not raise errors. */
+typedef int (*cmsgpack_ext_encoder)(lua_State *L, int idx,
+                                    const void **p, size_t *len);
+typedef int (*cmsgpack_ext_decoder)(lua_State *L, const char *p,
+                                    size_t len);
+
+/* Register C hooks for the ext 'type' and the metatable at the stack
+ * index 'mt' (0 to register just a decoder). Either hook can be NULL. */
+typedef void (*cmsgpack_register_ext_fn)(lua_State *L, int type, int mt,
+                                         cmsgpack_ext_encoder enc,
+                                         cmsgpack_ext_decoder dec);
+
+/* Functions published in the registry. New fields are only ever added at
+ * the end, bumping the version. */
+typedef struct cmsgpack_api {
+    int version;                        /* CMSGPACK_API_VERSION */
+    cmsgpack_register_ext_fn register_ext;
+} cmsgpack_api;
+
+LUALIB_API void cmsgpack_register_ext(lua_State *L, int type, int mt,
+                                      cmsgpack_ext_encoder enc,
+                                      cmsgpack_ext_decoder dec);
+
+#endif
@@ -89,6 +89,29 @@ function test_unpack(name,raw,obj)
     end
 end
 
+function test_codec(name,codec,obj)
+    io.write("Codec test '",name,"' ...")
+    if not compare_objects(obj,codec:unpack(codec:pack(obj))) then
+        print("ERROR:", obj, codec:unpack(codec:pack(obj)))
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+function test_unpack_error(name,raw,err)
+    io.write("Testing decoder error '",name,"' ...")
+    local ok, msg = pcall(cmsgpack.unpack,unhex(raw))
+    if ok or not string.find(msg,err,1,true) then
+        print("ERROR:", raw, ok, msg)
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
 function test_pack_and_unpack(name,obj,raw)
     test_pack(name,obj,raw)
     test_unpack(name,raw,obj)
@@ -140,15 +163,614 @@ test_pack_and_unpack("int8",-64,"d0c0")
 test_pack_and_unpack("int16",-1024,"d1fc00")
 test_pack_and_unpack("int32",-1048576,"d2fff00000")
 test_pack_and_unpack("int64",-1099511627776,"d3ffffff0000000000")
-test_pack_and_unpack("raw16","                                        ","da002820202020202020202020202020202020202020202020202020202020202020202020202020202020")
+test_pack_and_unpack("str8","                                        ","d92820202020202020202020202020202020202020202020202020202020202020202020202020202020")
+test_unpack("str16","da002820202020202020202020202020202020202020202020202020202020202020202020202020202020","                                        ")
+test_pack_and_unpack("str16",string.rep(" ",256),"da0100"..string.rep("20",256))
+test_unpack("bin8","c403616263","abc")
+test_unpack("bin16","c50003616263","abc")
+test_unpack("bin32","c600000003616263","abc")
 test_pack_and_unpack("array 16",{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},"dc001000000000000000000000000000000000")
 
--- Regression test for issue #4, cyclic references in tables.
+-- Lua >= 5.3 integers are encoded and decoded without going through floats.
+if math.type then
+    test_pack("int64 max",math.maxinteger,"cf7fffffffffffffff")
+    test_pack("int64 min",math.mininteger,"d38000000000000000")
+    test_pack_and_unpack("uint64 above 2^53",9007199254740993,"cf0020000000000001")
+    test_circular("int64 above 2^53",-9007199254740993)
+    io.write("Testing decoder 'integer subtype' ...")
+    if math.type(cmsgpack.unpack(unhex("cd8000"))) ~= "integer" then
+        print("ERROR")
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+    io.write("Testing decoder 'uint64 wrap option' ...")
+    if cmsgpack.new({uint64="wrap"}):unpack(unhex("cfffffffffffffffff")) ~= -1 then
+        print("ERROR")
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+test_pack("huge float",1e300,"cb7e37e43c8800759c")
+
+-- Tables are presized from the header, capped by the input length.
+test_unpack_error("array 32 huge count","ddffffffff","Missing bytes")
+test_unpack_error("map 32 huge count","dfffffffff01","Missing bytes")
+test_unpack("map 16 presized","de0002a16101a16202",{a=1,b=2})
+
+-- Tables are encoded in a single pass, with the header patched at the end.
+test_pack("mixed table",{1,2,3,n=3},"84010102020303a16e03")
+test_pack("table with holes",{1,nil,3},"8201010303")
+test_circular("map 16",{a=1,b=2,c=3,d=4,e=5,f=6,g=7,h=8,i=9,j=10,k=11,l=12,m=13,n=14,o=15,p=16,q=17})
+test_circular("nested map 16",{{a=1,b=2,c=3,d=4,e=5,f=6,g=7,h=8,i=9,j=10,k=11,l=12,m=13,n=14,o=15,p=16},x={}})
+
+-- Arrays of numbers are encoded and decoded in a single loop.
+test_pack_and_unpack("numbers array",{0,-1,200,-200,70000,-70000,1.5,0.1},"9800ffccc8d1ff38ce00011170d2fffeee90ca3fc00000cb3fb999999999999a")
+test_unpack("numbers then others","940102a17803",{1,2,"x",3})
+test_unpack_error("numbers array truncated","9301cb3ff0","Missing bytes")
+doubles = {}
+for i=1,10000 do doubles[i] = i+0.1 end
+test_circular("big doubles array",doubles)
+
+-- Regression test for issue #4, cyclic references in tables: the encoder
+-- must stop at the max nesting and raise an error.
 a = {x=nil,y=5}
 b = {x=a}
 a['x'] = b
-pack = cmsgpack.pack(a)
-test_pack("regression for issue #4",a,"82a17905a17881a17882a17905a17881a17882a17905a17881a17882a17905a17881a17882a17905a17881a17882a17905a17881a17882a17905a17881a17882a17905a17881a178c0")
+io.write("Testing encoder 'regression for issue #4' ...")
+ok, msg = pcall(cmsgpack.pack,a)
+if ok or not string.find(msg,"Nesting too deep while encoding",1,true) then
+    print("ERROR:", ok, msg)
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+-- Deep nesting is walked without C recursion, up to the codec max_depth
+-- (and to the stack slots available to C functions, 8000 in Lua 5.1).
+deep = {}
+for i=1,3000 do deep = {deep} end
+test_codec("deep nesting",cmsgpack.new({max_depth=6000}),deep)
+io.write("Testing decoder error 'nesting too deep' ...")
+ok, msg = pcall(cmsgpack.unpack,string.rep("\145",100000).."\1")
+if ok or not string.find(msg,"Nesting too deep in input",1,true) then
+    print("ERROR:", ok, msg)
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+-- Tables references: "strict" stops at cycles, "dedupe" encodes tables
+-- met again as references and rebuilds the shared structure.
+io.write("Testing refs 'strict' ...")
+codec = cmsgpack.new({refs="strict"})
+ok, msg = pcall(codec.pack,codec,a)
+if ok or not string.find(msg,"Table cycle while encoding",1,true) then
+    print("ERROR:", ok, msg)
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+io.write("Testing refs 'dedupe' ...")
+codec = cmsgpack.new({refs="dedupe"})
+shared = {1}
+raw = codec:pack({shared,shared})
+dup = codec:unpack(raw)
+cyc = codec:unpack(codec:pack(a))
+if hex(raw) ~= "929101d47f01" or dup[1] ~= dup[2] or
+   not compare_objects(dup[1],shared) or cyc.x.x ~= cyc or cyc.y ~= 5 then
+    print("ERROR:", hex(raw))
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+test_unpack_error("reference without refs","929101d47f01","Bad data format")
+
+-- Codec instances keep their buffer across calls, make sure a small
+-- initial buffer growing and shrinking back produces the same output.
+codec = cmsgpack.new({buffer_size=4, shrink_after=2})
+test_codec("small object",codec,{1,2,3})
+test_codec("big object",codec,{string.rep("x",70000),{a=1,b={true,false}}})
+test_codec("small object after shrink",codec,{a="b"})
+test_codec("default options",cmsgpack.new(),{1.5,"foo",{x=-1}})
+
+-- Streaming unpacker, fed one byte at a time and then all at once.
+function test_unpacker(name,chunksize,objs)
+    io.write("Testing unpacker '",name,"' ...")
+    local stream, got = "", {}
+    local u = cmsgpack.unpacker()
+    for i = 1, #objs do stream = stream .. cmsgpack.pack(objs[i]) end
+    for i = 1, #stream, chunksize do
+        u:feed(string.sub(stream,i,i+chunksize-1))
+        for _, obj in u.next, u do got[#got+1] = obj end
+    end
+    if not compare_objects(got,objs) or u:buffered() ~= 0 then
+        print("ERROR:", #got, u:buffered())
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+stream_objs = {{1,2,{a="xyz"}},300,string.rep("x",100),{},false,-1.5}
+test_unpacker("one byte chunks",1,stream_objs)
+test_unpacker("three bytes chunks",3,stream_objs)
+test_unpacker("single chunk",100000,stream_objs)
+
+-- Input that is not MessagePack is dropped, reset() drops partial objects
+-- and ext decoders can't feed the unpacker that is decoding.
+io.write("Testing unpacker errors and reset ...")
+local u = cmsgpack.unpacker()
+u:feed("\193\1")
+local badfmt = not pcall(u.next,u) and u:buffered() == 0
+u:feed("\146\1")
+u:reset()
+u:feed("\145\1")
+local _, resetobj = u:next()
+cmsgpack.register_ext(7,nil,nil,function(data) u:feed(data) return data end)
+u:feed(cmsgpack.pack(cmsgpack.ext(7,"ab")))
+ok, err = pcall(u.next,u)
+cmsgpack.register_ext(7)
+u:feed("\2")
+local _, afterhook = u:next()
+if not badfmt or resetobj[1] ~= 1 or #resetobj ~= 1 or ok or
+   not string.find(err,"while decoding") or afterhook ~= 2 then
+    print("ERROR:", badfmt, ok, err, afterhook)
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+-- Multiple objects packed together, decoded one by one and in batches.
+function test_multi(name,...)
+    io.write("Testing multiple objects '",name,"' ...")
+    local n, objs = select("#",...), {...}
+    local raw, pos, ok = cmsgpack.pack(...), 1, true
+    for i = 1, n do
+        local obj
+        obj, pos = cmsgpack.unpack_one(raw,pos)
+        ok = ok and compare_objects(obj,objs[i])
+    end
+    ok = ok and pos == #raw+1
+    local all = {cmsgpack.unpack_limit(raw,0)}
+    ok = ok and #all == n+1 and all[n+1] == pos
+    local two = {cmsgpack.unpack_limit(raw,2,1)}
+    ok = ok and two[3] == #cmsgpack.pack(objs[1],objs[2])+1
+    if not ok then
+        print("ERROR:", hex(raw), pos)
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+test_multi("scalars",1,"ab",true,-1.5)
+test_multi("tables",{1,2,3},{a={b=1}},{},"end")
+test_unpack_error("extra bytes","0102","Extra bytes")
+
+-- Compiled encoders, with fallback to the generic encoder.
+function test_compiled(name,encode,obj,raw)
+    io.write("Testing compiled encoder '",name,"' ...")
+    local packed = encode(obj)
+    if not compare_objects(cmsgpack.unpack(packed),obj) or
+       (raw and hex(packed) ~= raw) then
+        print("ERROR:", obj, hex(packed), raw)
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+encode_record = cmsgpack.compile({"b","a",3})
+test_compiled("template order",encode_record,{a=1,b=2,[3]="x"},"83a16202a1610103a178")
+test_compiled("missing field",encode_record,{a=1},"81a16101")
+test_compiled("unknown field",encode_record,{a=1,z=2})
+test_compiled("unknown fields only",encode_record,{y=1,z=2})
+io.write("Testing compiled encoder 'trusted' ...")
+trusted_record = cmsgpack.compile({"b","a",3},{trusted=true})
+if hex(trusted_record({a=1,b=2})) ~= "82a16202a16101" or
+   hex(trusted_record({a=1,z=2})) ~= "81a16101" then
+    print("ERROR:", hex(trusted_record({a=1,z=2})))
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+test_compiled("nested values",encode_record,{a={1,2},b={x=1}})
+test_compiled("not a table",encode_record,5,"05")
+
+-- Pre-packed fragments and frozen tables are copied verbatim.
+test_pack("raw fragment",{1,cmsgpack.raw(unhex("92a178c3"))},"920192a178c3")
+test_pack("prepacked table",{a=cmsgpack.prepack({1,2})},"81a161920102")
+frozen_codec = cmsgpack.new()
+frozen = frozen_codec:freeze({x=1})
+frozen.x = 99
+io.write("Testing frozen table ...")
+if hex(frozen_codec:pack({frozen,frozen})) ~= "9281a1780181a17801" or
+   hex(cmsgpack.pack(frozen)) ~= "81a17863" then
+    print("ERROR:", hex(frozen_codec:pack({frozen,frozen})))
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+-- Lazy views decode only the accessed elements.
+function test_view(name,obj,path)
+    io.write("Testing view '",name,"' ...")
+    local v, o = cmsgpack.view(cmsgpack.pack(obj)), obj
+    for i = 1, #path do
+        v, o = v[path[i]], o[path[i]]
+    end
+    if type(v) == "userdata" then v = v() end
+    if not compare_objects(v,o) then
+        print("ERROR:", v, o)
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+view_obj = {a=1,meta={tenant={10,20,{x="deep"}},name="n"},[7]="seven",list={}}
+test_view("whole object",view_obj,{})
+test_view("map field",view_obj,{"a"})
+test_view("integer key",view_obj,{7})
+test_view("missing key",view_obj,{"nope"})
+test_view("nested path",view_obj,{"meta","tenant",3,"x"})
+test_view("nested view",view_obj,{"meta","tenant"})
+test_view("empty array",view_obj,{"list"})
+test_view("out of range index",view_obj,{"meta","tenant",4})
+test_view("scalar",1.5,{})
+
+v = cmsgpack.view(cmsgpack.pack(view_obj))
+n = 0
+for k, val in getmetatable(v).__pairs(v) do n = n+1 end
+io.write("Testing view length and pairs ...")
+if not compare_objects({#v,#v.meta.tenant,n},{4,3,4}) then
+    print("ERROR:", #v, #v.meta.tenant, n)
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+-- Path extraction decodes only the target value.
+function test_get(name,obj,expected,...)
+    io.write("Testing get '",name,"' ...")
+    local n, v = select("#",cmsgpack.get(cmsgpack.pack(obj),...)), cmsgpack.get(cmsgpack.pack(obj),...)
+    if not compare_objects(v,expected) or (expected == nil and n ~= 0) then
+        print("ERROR:", v, expected, n)
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+test_get("map field",view_obj,1,"a")
+test_get("nested path",view_obj,"deep","meta","tenant",3,"x")
+test_get("nested table",view_obj,{10,20,{x="deep"}},"meta","tenant")
+test_get("integer key",view_obj,"seven",7)
+test_get("missing key",view_obj,nil,"nope")
+test_get("through a scalar",view_obj,nil,"a","b")
+test_get("out of range index",view_obj,nil,"meta","tenant",4)
+test_get("no path",{1,2},{1,2})
+
+-- Validation and scanning.
+function test_validate(name,raw,expected,pos)
+    io.write("Testing validate '",name,"' ...")
+    local ok, res, epos = cmsgpack.validate(unhex(raw))
+    if (ok and res ~= expected) or
+       (not ok and (not string.find(res,expected,1,true) or epos ~= pos)) then
+        print("ERROR:", raw, ok, res, epos)
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+test_validate("two objects","93010203a3616263",2)
+test_validate("empty input","",0)
+test_validate("bad format","9301c1","Bad data format",3)
+test_validate("truncated","930102","Missing bytes",4)
+test_validate("too deep",string.rep("91",300).."01","Nesting too deep",257)
+
+io.write("Testing scan ...")
+info = cmsgpack.scan(cmsgpack.pack({1,{a="xyz"},{}},"hello"))
+if not compare_objects(info,{objects=2,elements=7,depth=2,arrays=2,maps=1,
+                             string_bytes=9}) then
+    print("ERROR:", info.objects, info.elements, info.depth)
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+-- Typed numeric arrays, encoded as ext values and decoded as arrays.
+function test_typed(name,type,t,raw)
+    io.write("Testing typed array '",name,"' ...")
+    local packed = cmsgpack.pack(cmsgpack.array(type,t))
+    local a = cmsgpack.unpack(packed)
+    if (raw and hex(packed) ~= raw) or #a ~= #t or a:type() ~= type or
+       not compare_objects(a:totable(),t) or a[#t+1] ~= nil then
+        print("ERROR:", hex(packed))
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+test_typed("f64","f64",{1.5,-2,0.1},
+    "c7197e003ff8000000000000c0000000000000003fb999999999999a")
+test_typed("f32","f32",{1.5,-0.25},"c7097e013fc00000be800000")
+test_typed("i32","i32",{1,-1,2147483647,-2147483648},
+    "c7117e0200000001ffffffff7fffffff80000000")
+test_typed("i64","i64",{1,-1,2^40})
+test_typed("empty","f64",{},"d47e00")
+big = {}
+for i=1,1000 do big[i] = i+0.5 end
+test_typed("big","f64",big)
+test_unpack_error("typed array bad length","d57e0000","Bad data format")
+test_validate("ext","d40100c7097e013fc00000be800000",2)
+
+-- Strings as bin, timestamps and other ext types.
+io.write("Testing strings 'bin' ...")
+codec = cmsgpack.new({strings="bin"})
+raw = codec:pack({a="xyz"})
+if hex(raw) ~= "81c40161c40378797a" or codec:unpack(raw).a ~= "xyz" then
+    print("ERROR:", hex(raw))
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+test_pack("timestamp 32",cmsgpack.timestamp(1600000000),"d6ff5f5e1000")
+test_pack("timestamp 64",cmsgpack.timestamp(1600000000.5),"d7ff773594005f5e1000")
+test_pack("timestamp 96",cmsgpack.timestamp(-1,5),"c70cff00000005ffffffffffffffff")
+test_unpack("timestamp 32","d6ff5f5e1000",1600000000)
+test_unpack("timestamp 64","d7ff773594005f5e1000",1600000000.5)
+test_unpack_error("timestamp bad length","d5ff0000","Bad data format")
+
+io.write("Testing ext ...")
+e = cmsgpack.unpack(cmsgpack.pack(cmsgpack.ext(5,"abc")))
+raw = cmsgpack.pack(cmsgpack.unpack(unhex("d4fb01")))
+if e.type ~= 5 or e.data ~= "abc" or hex(raw) ~= "d4fb01" then
+    print("ERROR:", e.type, e.data, hex(raw))
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+-- Ext types registered for a metatable, here the one of files.
+io.write("Testing register_ext ...")
+cmsgpack.register_ext(7,getmetatable(io.stdout),
+    function(f) return f == io.stdout and "stdout" or "file" end,
+    function(data,type) return type..":"..data end)
+raw = cmsgpack.pack({io.stdout})
+obj = cmsgpack.unpack(raw)
+cmsgpack.register_ext(7,getmetatable(io.stdout))
+-- C modules find the C API in the registry.
+if hex(raw) ~= "91c706077374646f7574" or obj[1] ~= "7:stdout" or
+   hex(cmsgpack.pack(io.stdout)) ~= "c0" or
+   type(debug.getregistry()["cmsgpack.api"]) ~= "userdata" then
+    print("ERROR:", hex(raw), obj[1])
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+-- A Lua error raised while encoding, here by a hook that rehashes the table
+-- being traversed, must release the codec: otherwise every later call would
+-- allocate a new codec. Calls on a released codec allocate nothing but the
+-- result, here an interned string.
+io.write("Testing codec release on Lua errors ...")
+local function codec_growth(c)
+    c:pack(1)
+    collectgarbage("collect")
+    collectgarbage("stop")
+    local k = collectgarbage("count")
+    for _ = 1, 100 do c:pack(1) end
+    k = collectgarbage("count")-k
+    collectgarbage("restart")
+    return k
+end
+local victim = {u = io.stdout}
+for i = 1, 8 do victim["k"..i] = i end
+cmsgpack.register_ext(7,getmetatable(io.stdout),function()
+    for k in pairs(victim) do victim[k] = nil end
+    for i = 1, 200 do victim["n"..i] = i end
+    return "x"
+end)
+codec = cmsgpack.new()
+local before = codec_growth(codec)
+ok, err = pcall(codec.pack,codec,victim)
+cmsgpack.register_ext(7,getmetatable(io.stdout))
+if ok or before > 1 or codec_growth(codec) > before+1 then
+    print("ERROR:", ok, err, before)
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+-- Big strings decoded as slices of the input.
+io.write("Testing slices ...")
+raw = cmsgpack.pack({blob=string.rep("x",1000),name="short"})
+obj = cmsgpack.unpack(raw,100)
+if type(obj.blob) ~= "userdata" or obj.blob:len() ~= 1000 or
+   obj.name ~= "short" or obj.blob:sub(2,4):tostring() ~= "xxx" or
+   tostring(obj.blob) ~= string.rep("x",1000) or
+   cmsgpack.pack(obj.blob) ~= cmsgpack.pack(string.rep("x",1000)) or
+   type(cmsgpack.unpack(raw).blob) ~= "string" then
+    print("ERROR:", type(obj.blob))
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+-- Streaming packer: small buffer flushed to a function and to a file.
+io.write("Testing packer ...")
+chunks = {}
+packer = cmsgpack.packer(function(s) chunks[#chunks+1] = s end,
+                         {flush_bytes=8})
+packer:array_begin(100)
+for i=1,100 do packer:pack({i,"x"}) end
+packer:flush()
+f = io.tmpfile()
+fpacker = cmsgpack.packer(f)
+fpacker:pack({1,2,3},"hello")
+fpacker:flush()
+f:seek("set")
+fdata = f:read("*a")
+f:close()
+obj = cmsgpack.unpack(table.concat(chunks))
+-- Writing to a closed file is an error, not a write through a stale FILE.
+f = io.tmpfile()
+fpacker = cmsgpack.packer(f)
+f:close()
+fpacker:pack({1})
+ok, err = pcall(fpacker.flush,fpacker)
+if #chunks < 50 or #obj ~= 100 or obj[100][1] ~= 100 or
+   packer:bytes() ~= #table.concat(chunks) or
+   fdata ~= cmsgpack.pack({1,2,3},"hello") or ok or
+   not string.find(err,"closed file",1,true) then
+    print("ERROR:", #chunks, #obj)
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+-- Hooks and the sink can't use the packer while it is busy, and a value
+-- that raises a Lua error half way, here by rehashing the table being
+-- traversed, leaves nothing in the stream.
+io.write("Testing packer re-entrancy ...")
+chunks = {}
+local sinkok
+packer = cmsgpack.packer(function(s)
+    chunks[#chunks+1] = s
+    sinkok = pcall(packer.pack,packer,0)
+end,{flush_bytes=4})
+cmsgpack.register_ext(7,getmetatable(io.stdout),function()
+    packer:flush()
+    return "x"
+end)
+local hookok, hookerr = pcall(packer.pack,packer,{1,2,3,4,io.stdout})
+victim = {u = io.stdout}
+for i = 1, 8 do victim["k"..i] = i end
+cmsgpack.register_ext(7,getmetatable(io.stdout),function()
+    for k in pairs(victim) do victim[k] = nil end
+    for i = 1, 200 do victim["n"..i] = i end
+    return "x"
+end)
+ok = pcall(packer.pack,packer,{1,2,3},victim)
+cmsgpack.register_ext(7,getmetatable(io.stdout))
+packer:pack("end")
+packer:flush()
+raw = table.concat(chunks)
+if hookok or not string.find(hookerr,"busy",1,true) or ok or
+   sinkok ~= false or raw ~= cmsgpack.pack({1,2,3},"end") or
+   packer:bytes() ~= #raw then
+    print("ERROR:", hookok, hookerr, ok, sinkok, hex(raw))
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+-- Resumable jobs, stepped with a tiny budget.
+io.write("Testing jobs ...")
+obj = {a={1,2,{x="hello",y={true,false}}},b="world",c={1.5,-3,300}}
+job = cmsgpack.encoder(obj,4)
+steps = 0
+repeat steps = steps+1; done, raw = job:step() until done
+co = coroutine.wrap(function() return cmsgpack.decoder(raw,4):run() end)
+repeat res = co() until res
+if steps < 3 or raw ~= cmsgpack.pack(obj) or res.a[3].x ~= "hello" or
+   res.c[3] ~= 300 or not res.a[3].y[1] then
+    print("ERROR:", steps)
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+-- Decoding into the tables of a previous result.
+io.write("Testing unpack_into ...")
+state = {a={1,2,3},b={x=1,y=2},c="old"}
+nested = state.a
+res = cmsgpack.unpack_into(state,cmsgpack.pack({a={4,5},b={x=3}}))
+ok = res == state and state.a == nested and #state.a == 2 and
+     state.a[2] == 5 and state.b.x == 3 and state.b.y == 2 and
+     state.c == "old"
+cmsgpack.unpack_into(state,cmsgpack.pack({a={6}}),true)
+ok = ok and state.a == nested and state.a[1] == 6 and #state.a == 1 and
+     state.b == nil and state.c == nil
+-- Prune with a nil value ({a=nil}) and with a repeated key ({a=1,a=2}).
+nilval = cmsgpack.unpack_into({a=1,b=2},"\129\161a\192",true)
+repeated = cmsgpack.unpack_into({a=0,z=9},"\130\161a\1\161a\2",true)
+if not ok or next(nilval) ~= nil or repeated.a ~= 2 or
+   repeated.z ~= nil then
+    print("ERROR")
+    failed = failed+1
+else
+    print("ok")
+    passed = passed+1
+end
+
+-- Codec statistics, only available when built with LUACMSGPACK_STATS.
+if cmsgpack.stats then
+    io.write("Testing stats ...")
+    codec = cmsgpack.new()
+    raw = codec:pack({1,"a",{x=300}})
+    raw2 = codec:pack({{{}}})
+    codec:unpack(raw2)
+    st = codec:stats()
+    ok = st.pack_calls == 2 and st.unpack_calls == 1 and
+         st.bytes_out == #raw+#raw2 and st.bytes_in == #raw2 and
+         st.max_depth == 3 and st.types.fixarray == 4 and
+         st.types.fixstr == 2 and st.types.fixmap == 1 and
+         st.types.uint16 == 1 and st.types.fixint == 1 and
+         st.buffer_peak >= #raw and cmsgpack.stats().pack_calls ~= nil
+    codec:reset_stats()
+    st = codec:stats()
+    ok = ok and st.pack_calls == 0 and next(st.types) == nil
+    -- Tables encoded again in another format are counted once, fragments
+    -- by their elements.
+    local seq = {}
+    seq[3] = 3; seq[2] = 2; seq[1] = 1
+    codec:pack({1,2,3,n=3},cmsgpack.raw("\145\195"),seq)
+    st = codec:stats()
+    ok = ok and st.types.fixmap == 1 and st.types.fixint == 10 and
+         st.types.fixstr == 1 and st.types.fixarray == 2 and
+         st.types["true"] == 1
+    if not ok then
+        print("ERROR")
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
 
 -- Final report
 print()